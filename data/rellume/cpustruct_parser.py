@@ -13,7 +13,7 @@ PUBLIC_MACROS = (
 PRIVATE_MACROS = (
     (
         "RELLUME_MAPPED_REG", lambda e: "reg" in e,
-        "RELLUME_MAPPED_REG({offset}, LLReg(LL_RT_{reg[0]}, {reg[1]}), Facet::{reg[2]})",
+        "RELLUME_MAPPED_REG({NAME}, {offset}, LLReg(LL_RT_{reg[0]}, {reg[1]}), Facet::{reg[2]})",
     ),
     (
         "RELLUME_NAMED_REG", lambda e: "name" in e,
@@ -21,6 +21,18 @@ PRIVATE_MACROS = (
     ),
 )
 
+# Argument and return value slots of mapped registers for calling conventions
+# which pass registers directly. index is the index of the mapped register,
+# missing argument/return slots are -1. For sysv, slots are numbered in the
+# order of the host argument registers; the CPU struct pointer is appended
+# after the last argument and is not part of the description.
+SLOT_MACROS = (
+    (
+        "RELLUME_CALLCONV_SLOT",
+        "RELLUME_CALLCONV_SLOT({CC}, {index}, {arg}, {ret}, Facet::{facet})",
+    ),
+)
+
 if __name__ == "__main__":
     parser = argparse.ArgumentParser()
     parser.add_argument("-p", "--private", action="store_true")
@@ -38,6 +50,23 @@ if __name__ == "__main__":
             entry["NAME"] = entry["name"].upper()
         off += entry["size"]
 
+    slots = []
+    for index, entry in enumerate(e for e in desc if "reg" in e):
+        for cc, slot in sorted(entry.get("callconv", {}).items()):
+            slots.append({
+                "CC": cc.upper(), "index": index,
+                "arg": slot.get("arg", -1), "ret": slot.get("ret", -1),
+                "facet": slot.get("facet", entry["reg"][2]),
+            })
+
+    used = set()
+    for slot in slots:
+        for kind in ("arg", "ret"):
+            key = (slot["CC"], kind, slot[kind])
+            if slot[kind] >= 0 and key in used:
+                raise Exception("duplicate {} slot {} for {}".format(kind, slot[kind], slot["CC"]))
+            used.add(key)
+
     macros = PUBLIC_MACROS if not args.private else PRIVATE_MACROS
 
     res = ""
@@ -46,5 +75,11 @@ if __name__ == "__main__":
         for entry in (e for e in desc if include(e)):
             res += fmt.format(**entry) + "\n"
         res += "#endif\n"
+    if args.private:
+        for name, fmt in SLOT_MACROS:
+            res += "#ifdef {}\n".format(name)
+            for slot in slots:
+                res += fmt.format(**slot) + "\n"
+            res += "#endif\n"
 
     args.output.write(res)
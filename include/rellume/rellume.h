@@ -41,17 +41,64 @@ extern "C" {
 
 typedef struct LLConfig LLConfig;
 
+typedef enum {
+    RELLUME_MEMORY_MODEL_DEFAULT = 0,
+    RELLUME_MEMORY_MODEL_TSO = 1,
+    RELLUME_MEMORY_MODEL_SINGLE_THREADED = 2,
+} LLMemoryModel;
+
+typedef enum {
+    /// Pass all registers in the CPU struct.
+    RELLUME_CALL_CONV_SPTR = 0,
+    /// HHVM calling convention, most GP registers are passed in registers.
+    RELLUME_CALL_CONV_HHVM = 1,
+    /// C calling convention, argument and return registers of the System V
+    /// ABI are passed in the same registers. The function takes RDI, RSI,
+    /// RDX, RCX, R8, R9, XMM0-7 and the CPU struct pointer, and returns RAX,
+    /// RDX, XMM0 and XMM1. RIP and all other registers are in the CPU struct.
+    RELLUME_CALL_CONV_SYSV = 2,
+    /// Like SYSV, but using the preserve_all calling convention.
+    RELLUME_CALL_CONV_PRESERVE_ALL = 3,
+} LLCallConv;
+
+typedef enum {
+    /// Layout as described in cpustruct.inc.
+    RELLUME_CPU_LAYOUT_DEFAULT = 0,
+    /// Flags packed into a single word ("eflags"), vector registers in
+    /// separate cache lines. Use ll_config_cpu_struct_size for the size.
+    RELLUME_CPU_LAYOUT_PACKED = 1,
+} LLCpuLayout;
+
 RELLUME_API LLConfig* ll_config_new(void);
 RELLUME_API void ll_config_free(LLConfig*);
 
 RELLUME_API void ll_config_set_hhvm(LLConfig*, bool);
+RELLUME_API void ll_config_set_call_conv(LLConfig*, LLCallConv);
 RELLUME_API void ll_config_enable_overflow_intrinsics(LLConfig*, bool);
 RELLUME_API void ll_config_enable_fast_math(LLConfig*, bool);
 RELLUME_API void ll_config_enable_verify_ir(LLConfig*, bool);
+RELLUME_API void ll_config_enable_pointer_provenance(LLConfig*, bool);
+RELLUME_API void ll_config_enable_stack_promotion(LLConfig*, bool);
+RELLUME_API void ll_config_enable_stack_tracking(LLConfig*, bool);
+RELLUME_API void ll_config_enable_access_type_unification(LLConfig*, bool);
+RELLUME_API void ll_config_enable_alignment_propagation(LLConfig*, bool);
 RELLUME_API void ll_config_set_global_base(LLConfig*, uintptr_t, LLVMValueRef);
 RELLUME_API void ll_config_set_instr_impl(LLConfig*, LLInstrType, LLVMValueRef);
 RELLUME_API void ll_config_set_call_ret_clobber_flags(LLConfig*, bool);
 RELLUME_API void ll_config_set_use_native_segment_base(LLConfig*, bool);
+RELLUME_API void ll_config_set_memory_model(LLConfig*, LLMemoryModel);
+RELLUME_API void ll_config_set_target(LLConfig*, const char* cpu,
+                                      const char* features);
+RELLUME_API void ll_config_set_cpu_layout(LLConfig*, LLCpuLayout);
+RELLUME_API bool ll_config_set_cpu_reg_offset(LLConfig*, const char* name,
+                                              size_t offset);
+RELLUME_API void ll_config_set_packed_flags(LLConfig*, bool);
+RELLUME_API size_t ll_config_cpu_struct_size(LLConfig*);
+RELLUME_API int64_t ll_config_cpu_reg_offset(LLConfig*, const char* name);
+RELLUME_API void ll_config_set_hook_block(LLConfig*, LLVMValueRef);
+RELLUME_API void ll_config_set_hook_mem_access(LLConfig*, LLVMValueRef);
+RELLUME_API void ll_config_set_hook_indirect_branch(LLConfig*, LLVMValueRef);
+RELLUME_API void ll_config_set_profile_counters(LLConfig*, LLVMValueRef);
 
 
 struct LLFunc;
@@ -60,10 +107,22 @@ typedef struct LLFunc LLFunc;
 
 RELLUME_API LLFunc* ll_func_new(LLVMModuleRef mod, LLConfig*);
 
+RELLUME_API void ll_func_add_entry(LLFunc* fn, uint64_t addr);
 RELLUME_API void ll_func_add_inst(LLFunc* fn, uint64_t block_addr, LLInstr* instr);
+RELLUME_API void ll_func_set_profile(LLFunc* fn, uint64_t block_addr, uint64_t count);
+RELLUME_API void ll_func_set_edge_profile(LLFunc* fn, uint64_t from, uint64_t to,
+                                          uint64_t count);
+RELLUME_API void ll_func_set_live_out(LLFunc* fn, const LLReg* regs, size_t count);
+RELLUME_API void ll_func_set_exit_live_out(LLFunc* fn, uint64_t target,
+                                           const LLReg* regs, size_t count);
 RELLUME_API LLVMValueRef ll_func_lift(LLFunc* fn);
 RELLUME_API void ll_func_dispose(LLFunc*);
 
+RELLUME_API size_t ll_func_counter_count(LLFunc* fn);
+RELLUME_API void ll_func_set_counter_base(LLFunc* fn, size_t base);
+RELLUME_API int64_t ll_func_block_counter(LLFunc* fn, uint64_t block_addr);
+RELLUME_API int64_t ll_func_edge_counter(LLFunc* fn, uint64_t from, uint64_t to);
+
 RELLUME_API int ll_func_decode(LLFunc* func, uintptr_t addr);
 typedef size_t(* RellumeMemAccessCb)(size_t, uint8_t*, size_t, void*);
 RELLUME_API int ll_func_decode2(LLFunc* func, uintptr_t addr,
@@ -76,9 +135,29 @@ typedef enum {
 RELLUME_API int ll_func_decode3(LLFunc* func, uintptr_t addr, LLDecodeStop stop,
                                 RellumeMemAccessCb mem_acc, void* user_arg);
 
+struct LLDecodeCache;
+
+typedef struct LLDecodeCache LLDecodeCache;
+
+RELLUME_API LLDecodeCache* ll_decode_cache_new(void);
+RELLUME_API void ll_decode_cache_free(LLDecodeCache*);
+RELLUME_API void ll_decode_cache_invalidate(LLDecodeCache*, uintptr_t start,
+                                            uintptr_t end);
+RELLUME_API int ll_func_decode4(LLFunc* func, uintptr_t addr, LLDecodeStop stop,
+                                RellumeMemAccessCb mem_acc, void* user_arg,
+                                LLDecodeCache* cache);
+
+RELLUME_API size_t ll_func_code_ranges(LLFunc* fn, uint64_t* ranges,
+                                       size_t max_ranges);
+RELLUME_API uint64_t ll_code_checksum(const uint64_t* ranges, size_t count,
+                                      RellumeMemAccessCb mem_acc, void* user_arg);
+
 RELLUME_API void ll_func_fast_opt(LLVMValueRef llvm_fn);
 RELLUME_API LLVMValueRef ll_func_wrap_sysv(LLVMValueRef llvm_fn, LLVMTypeRef ty,
                                            LLVMModuleRef mod, size_t stack_sz);
+RELLUME_API LLVMValueRef ll_func_wrap_sysv2(LLVMValueRef llvm_fn, LLVMTypeRef ty,
+                                            LLVMModuleRef mod, size_t stack_sz,
+                                            LLConfig* cfg);
 
 #ifdef __cplusplus
 }
@@ -49,7 +49,8 @@
 
 namespace rellume {
 
-BasicBlock::BasicBlock(llvm::Function* fn, const LLConfig& cfg, Kind kind)
+BasicBlock::BasicBlock(llvm::Function* fn, const LLConfig& cfg, Kind kind,
+                       const RegSet* live_regs, llvm::Value* exit_rip)
         : regfile() {
     llvm_block = llvm::BasicBlock::Create(fn->getContext(), "", fn, nullptr);
     regfile.SetInsertBlock(llvm_block);
@@ -71,9 +72,13 @@ BasicBlock::BasicBlock(llvm::Function* fn, const LLConfig& cfg, Kind kind)
     // back to memory.
     if (kind == ENTRY) {
         regfile.InitAll(nullptr);
-        cfg.callconv.Unpack(regfile, fn, &mem_ref_values);
+        cfg.callconv.Unpack(regfile, cfg.cpu_layout, fn, &mem_ref_values,
+                            /*lazy=*/true);
     } else if (kind == EXIT) {
-        llvm::Value* ret_val = cfg.callconv.Pack(regfile, fn, &mem_ref_values);
+        if (exit_rip != nullptr)
+            regfile.SetReg(LLReg(LL_RT_IP, 0), Facet::I64, exit_rip, true);
+        llvm::Value* ret_val = cfg.callconv.Pack(regfile, cfg.cpu_layout, fn,
+                                                  &mem_ref_values, live_regs);
 
         llvm::IRBuilder<> irb(llvm_block);
         if (ret_val == nullptr)
@@ -94,7 +99,7 @@ void BasicBlock::BranchTo(BasicBlock& next) {
 }
 
 void BasicBlock::BranchTo(llvm::Value* cond, BasicBlock& then,
-                             BasicBlock& other) {
+                             BasicBlock& other, llvm::MDNode* weights) {
     // In case both blocks are the same create a single branch only.
     if (std::addressof(then) == std::addressof(other)) {
         BranchTo(then);
@@ -104,12 +109,27 @@ void BasicBlock::BranchTo(llvm::Value* cond, BasicBlock& then,
     assert(!terminated && "attempting to add second terminator");
 
     llvm::IRBuilder<> irb(llvm_block);
-    irb.CreateCondBr(cond, then.llvm_block, other.llvm_block);
+    irb.CreateCondBr(cond, then.llvm_block, other.llvm_block, weights);
     then.predecessors.push_back(this);
     other.predecessors.push_back(this);
     terminated = true;
 }
 
+void BasicBlock::BranchTo(llvm::Value* val, BasicBlock& def,
+        const std::vector<std::pair<uint64_t, BasicBlock*>>& cases) {
+    assert(!terminated && "attempting to add second terminator");
+
+    // Every case is a separate edge, so add the predecessor for each of them.
+    llvm::IRBuilder<> irb(llvm_block);
+    llvm::SwitchInst* inst = irb.CreateSwitch(val, def.llvm_block, cases.size());
+    def.predecessors.push_back(this);
+    for (const auto& item : cases) {
+        inst->addCase(irb.getInt64(item.first), item.second->llvm_block);
+        item.second->predecessors.push_back(this);
+    }
+    terminated = true;
+}
+
 bool BasicBlock::FillPhis() {
     if (empty_phis.empty())
         return false;
@@ -139,7 +159,9 @@ void BasicBlock::RemoveUnmodifiedStores(const BasicBlock& entry) {
             continue;
 
         llvm::StoreInst* store = llvm::cast<llvm::StoreInst>(mem_ref_values[i]);
-        llvm::LoadInst* load = llvm::cast<llvm::LoadInst>(entry.mem_ref_values[i]);
+        // The entry loads registers lazily, so there might be no load at all.
+        // Registers passed as argument are never loaded from the CPU struct.
+        llvm::LoadInst* load = llvm::dyn_cast_or_null<llvm::LoadInst>(entry.mem_ref_values[i]);
 
         llvm::Value* stored_val = store->getValueOperand();
         if (!llvm::isa<llvm::PHINode>(stored_val)) {
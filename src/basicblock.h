@@ -30,7 +30,9 @@
 #include "rellume/instr.h"
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Function.h>
+#include <cstdint>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 
@@ -42,7 +44,12 @@ public:
     enum Kind {
         DEFAULT, ENTRY, EXIT
     };
-    BasicBlock(llvm::Function* fn, const LLConfig& cfg, Kind kind = DEFAULT);
+    /// Create a basic block. For EXIT blocks, live_regs optionally restricts
+    /// the registers which are stored back and exit_rip optionally is the
+    /// known value of RIP when leaving through this block.
+    BasicBlock(llvm::Function* fn, const LLConfig& cfg, Kind kind = DEFAULT,
+               const RegSet* live_regs = nullptr,
+               llvm::Value* exit_rip = nullptr);
 
     BasicBlock(BasicBlock&& rhs);
     BasicBlock& operator=(BasicBlock&& rhs);
@@ -51,9 +58,19 @@ public:
     BasicBlock& operator=(const BasicBlock&) = delete;
 
     void BranchTo(BasicBlock& next);
-    void BranchTo(llvm::Value* cond, BasicBlock& then, BasicBlock& other);
+    void BranchTo(llvm::Value* cond, BasicBlock& then, BasicBlock& other,
+                  llvm::MDNode* weights = nullptr);
+    void BranchTo(llvm::Value* val, BasicBlock& def,
+                  const std::vector<std::pair<uint64_t, BasicBlock*>>& cases);
     bool FillPhis();
 
+    /// Move the LLVM basic block to the end of the function.
+    void MoveToEnd() {
+        llvm::BasicBlock* last = &llvm_block->getParent()->back();
+        if (last != llvm_block)
+            llvm_block->moveAfter(last);
+    }
+
     void RemoveUnmodifiedStores(const BasicBlock& entry);
 
     llvm::Value* NextRip() {
@@ -95,9 +112,12 @@ private:
 
 public:
     ArchBasicBlock(llvm::Function* fn, const LLConfig& cfg,
-                   BasicBlock::Kind kind = BasicBlock::DEFAULT)
+                   BasicBlock::Kind kind = BasicBlock::DEFAULT,
+                   const RegSet* live_regs = nullptr,
+                   llvm::Value* exit_rip = nullptr)
             : fn(fn), cfg(cfg) {
-        low_blocks.push_back(std::make_unique<BasicBlock>(fn, cfg, kind));
+        low_blocks.push_back(std::make_unique<BasicBlock>(fn, cfg, kind,
+                                                          live_regs, exit_rip));
         insert_block = low_blocks[0].get();
     }
 
@@ -127,8 +147,21 @@ public:
     void BranchTo(ArchBasicBlock& next) {
         insert_block->BranchTo(next.BeginBlock());
     }
-    void BranchTo(llvm::Value* cond, ArchBasicBlock& then, ArchBasicBlock& other) {
-        insert_block->BranchTo(cond, then.BeginBlock(), other.BeginBlock());
+    void BranchTo(llvm::Value* cond, ArchBasicBlock& then, ArchBasicBlock& other,
+                  llvm::MDNode* weights = nullptr) {
+        insert_block->BranchTo(cond, then.BeginBlock(), other.BeginBlock(),
+                               weights);
+    }
+    void BranchTo(llvm::Value* val, ArchBasicBlock& def,
+                  const std::vector<std::pair<uint64_t, ArchBasicBlock*>>& cases) {
+        std::vector<std::pair<uint64_t, BasicBlock*>> low_cases;
+        for (const auto& item : cases)
+            low_cases.push_back(std::make_pair(item.first, &item.second->BeginBlock()));
+        insert_block->BranchTo(val, def.BeginBlock(), low_cases);
+    }
+    void MoveToEnd() {
+        for (const auto& lb : low_blocks)
+            lb->MoveToEnd();
     }
     bool FillPhis() {
         bool res = false;
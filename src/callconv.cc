@@ -27,55 +27,220 @@
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <memory>
 
 
 namespace rellume {
 
-llvm::FunctionType* CallConv::FnType(llvm::LLVMContext& ctx) const {
-    llvm::Type* void_ty = llvm::Type::getVoidTy(ctx);
-    llvm::Type* i8p = llvm::Type::getInt8PtrTy(ctx);
-    llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+static const size_t cpu_struct_default_offsets[] = {
+#define RELLUME_NAMED_REG(name,nameu,sz,off) off,
+#include <rellume/cpustruct-private.inc>
+#undef RELLUME_NAMED_REG
+};
+static const size_t cpu_struct_sizes[] = {
+#define RELLUME_NAMED_REG(name,nameu,sz,off) sz,
+#include <rellume/cpustruct-private.inc>
+#undef RELLUME_NAMED_REG
+    8, // EFLAGS
+};
+static const char* const cpu_struct_names[] = {
+#define RELLUME_NAMED_REG(name,nameu,sz,off) #name,
+#include <rellume/cpustruct-private.inc>
+#undef RELLUME_NAMED_REG
+    "eflags",
+};
+
+static bool IsFlagEntry(CpuStructLayout::Entry entry) {
+    return entry >= CpuStructLayout::ZF && entry <= CpuStructLayout::DF;
+}
+
+CpuStructLayout::CpuStructLayout() {
+    for (unsigned i = 0; i < EFLAGS; i++)
+        offsets[i] = cpu_struct_default_offsets[i];
+    // Without packed flags, the word overlaps with the individual flags.
+    offsets[EFLAGS] = offsets[ZF];
+}
+
+CpuStructLayout CpuStructLayout::Packed() {
+    CpuStructLayout res;
+    res.packed_flags = true;
+    // RIP and GP registers stay at the beginning, followed by the flag word
+    // and the segment bases. Vector registers start in a new cache line.
+    res.offsets[EFLAGS] = res.offsets[R15] + 8;
+    res.offsets[FSBASE] = res.offsets[EFLAGS] + 8;
+    res.offsets[GSBASE] = res.offsets[FSBASE] + 8;
+    size_t xmm_base = (res.offsets[GSBASE] + 8 + 63) & ~size_t{63};
+    for (unsigned i = 0; i < 16; i++)
+        res.offsets[XMM0 + i] = xmm_base + 16 * i;
+    for (unsigned i = ZF; i <= DF; i++)
+        res.offsets[i] = res.offsets[EFLAGS];
+    return res;
+}
 
-    switch (*this) {
+CpuStructLayout::Entry CpuStructLayout::Lookup(const char* name) {
+    for (unsigned i = 0; i < NUM_ENTRIES; i++)
+        if (!strcmp(name, cpu_struct_names[i]))
+            return static_cast<Entry>(i);
+    return NUM_ENTRIES;
+}
+
+size_t CpuStructLayout::Size() const {
+    size_t size = 0;
+    for (unsigned i = 0; i < NUM_ENTRIES; i++) {
+        Entry entry = static_cast<Entry>(i);
+        if (packed_flags ? IsFlagEntry(entry) : entry == EFLAGS)
+            continue;
+        size = std::max(size, offsets[i] + cpu_struct_sizes[i]);
+    }
+    return size;
+}
+
+static const std::tuple<CpuStructLayout::Entry, LLReg, Facet> cpu_struct_entries[] = {
+#define RELLUME_MAPPED_REG(nameu,off,reg,facet) std::make_tuple(CpuStructLayout::nameu, reg, facet),
+#include <rellume/cpustruct-private.inc>
+#undef RELLUME_MAPPED_REG
+};
+
+namespace {
+
+constexpr size_t entry_count = 0
+#define RELLUME_MAPPED_REG(nameu,off,reg,facet) + 1
+#include <rellume/cpustruct-private.inc>
+#undef RELLUME_MAPPED_REG
+    ;
+
+/// Argument and return struct field of a CPU struct entry, or -1 if the entry
+/// is passed in the CPU struct. The facet is the type used in the signature.
+struct EntrySlot {
+    int arg;
+    int ret;
+    Facet::Value facet;
+};
+
+struct SlotDef {
+    CallConv::Value cconv;
+    size_t index;
+    EntrySlot slot;
+};
+
+// Generated from cpustruct.json
+constexpr SlotDef slot_defs[] = {
+#define RELLUME_CALLCONV_SLOT(cconv,idx,arg,ret,facet) {CallConv::cconv, idx, {arg, ret, facet}},
+#include <rellume/cpustruct-private.inc>
+#undef RELLUME_CALLCONV_SLOT
+};
+
+/// Description of a calling convention with a lookup table indexed by the CPU
+/// struct entry. The CPU struct is always passed as argument sptr_idx.
+struct CallConvDesc {
+    llvm::CallingConv::ID cc;
+    unsigned sptr_idx;
+    unsigned arg_count;
+    unsigned ret_count;
+    EntrySlot slots[entry_count];
+};
+
+/// Pass the CPU struct after all register arguments.
+constexpr unsigned sptr_after_args = ~0u;
+
+constexpr CallConvDesc MakeDesc(CallConv::Value slot_cconv,
+                                llvm::CallingConv::ID cc, unsigned sptr_idx) {
+    CallConvDesc res{cc, sptr_idx, 0, 0, {}};
+    for (size_t i = 0; i < entry_count; i++)
+        res.slots[i] = EntrySlot{-1, -1, Facet::I64};
+    for (const SlotDef& def : slot_defs) {
+        if (def.cconv != slot_cconv)
+            continue;
+        res.slots[def.index] = def.slot;
+        if (def.slot.arg >= static_cast<int>(res.arg_count))
+            res.arg_count = static_cast<unsigned>(def.slot.arg) + 1;
+        if (def.slot.ret >= static_cast<int>(res.ret_count))
+            res.ret_count = static_cast<unsigned>(def.slot.ret) + 1;
+    }
+    if (sptr_idx == sptr_after_args)
+        res.sptr_idx = res.arg_count;
+    if (res.sptr_idx >= res.arg_count)
+        res.arg_count = res.sptr_idx + 1;
+    return res;
+}
+
+constexpr CallConvDesc desc_sptr =
+    MakeDesc(CallConv::SPTR, llvm::CallingConv::C, 0);
+constexpr CallConvDesc desc_hhvm =
+    MakeDesc(CallConv::HHVM, llvm::CallingConv::HHVM, 1);
+// RDI, RSI, RDX, RCX, R8, R9 are the first six integer arguments and XMM0-7
+// the vector arguments, so they are passed in the same host registers. The
+// CPU struct pointer is the seventh integer argument and passed on the stack.
+// RAX, RDX, XMM0 and XMM1 are returned in the same registers; the struct
+// return must not exceed these, otherwise it would be returned in memory.
+constexpr CallConvDesc desc_sysv =
+    MakeDesc(CallConv::SYSV, llvm::CallingConv::C, sptr_after_args);
+constexpr CallConvDesc desc_preserve_all =
+    MakeDesc(CallConv::SYSV, llvm::CallingConv::PreserveAll, sptr_after_args);
+
+const CallConvDesc& GetDesc(CallConv cconv) {
+    switch (cconv) {
     default:
-        return nullptr;
-    case CallConv::SPTR:
-        return llvm::FunctionType::get(void_ty, {i8p}, false);
-    case CallConv::HHVM: {
-        auto ret_ty = llvm::StructType::get(i64, i64, i64, i64, i64, i64, i64,
-                                            i64, i64, i64, i64, i64, i64, i64);
-        return llvm::FunctionType::get(ret_ty, {i64, i8p, i64, i64, i64, i64,
-                                                i64, i64, i64, i64, i64, i64,
-                                                i64, i64}, false);
+    case CallConv::SPTR: return desc_sptr;
+    case CallConv::HHVM: return desc_hhvm;
+    case CallConv::SYSV: return desc_sysv;
+    case CallConv::PRESERVE_ALL: return desc_preserve_all;
     }
+}
+
+} // end anonymous namespace
+
+llvm::FunctionType* CallConv::FnType(llvm::LLVMContext& ctx) const {
+    const CallConvDesc& desc = GetDesc(*this);
+
+    // Unused argument and return slots are i64.
+    llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+    llvm::SmallVector<llvm::Type*, 16> arg_tys(desc.arg_count, i64);
+    llvm::SmallVector<llvm::Type*, 16> ret_tys(desc.ret_count, i64);
+    for (const auto& slot : desc.slots) {
+        if (slot.arg >= 0)
+            arg_tys[slot.arg] = Facet(slot.facet).Type(ctx);
+        if (slot.ret >= 0)
+            ret_tys[slot.ret] = Facet(slot.facet).Type(ctx);
     }
+    arg_tys[desc.sptr_idx] = llvm::Type::getInt8PtrTy(ctx);
+
+    llvm::Type* ret_ty = llvm::Type::getVoidTy(ctx);
+    if (!ret_tys.empty())
+        ret_ty = llvm::StructType::get(ctx, ret_tys);
+
+    return llvm::FunctionType::get(ret_ty, arg_tys, false);
 }
 
 llvm::CallingConv::ID CallConv::FnCallConv() const {
-    switch (*this) {
-    default: return llvm::CallingConv::C;
-    case CallConv::SPTR: return llvm::CallingConv::C;
-    case CallConv::HHVM: return llvm::CallingConv::HHVM;
-    }
+    return GetDesc(*this).cc;
 }
 
 unsigned CallConv::CpuStructParamIdx() const {
-    switch (*this) {
-    default: return 0;
-    case CallConv::SPTR: return 0;
-    case CallConv::HHVM: return 1;
-    }
+    return GetDesc(*this).sptr_idx;
 }
 
-static const std::tuple<size_t, LLReg, Facet> cpu_struct_entries[] = {
-#define RELLUME_MAPPED_REG(off,reg,facet) std::make_tuple(off, reg, facet),
-#include <rellume/cpustruct-private.inc>
-#undef RELLUME_MAPPED_REG
-};
+/// Bit position of a flag in the EFLAGS register.
+static unsigned FlagBit(Facet facet) {
+    switch (facet) {
+    case Facet::CF: return 0;
+    case Facet::PF: return 2;
+    case Facet::AF: return 4;
+    case Facet::ZF: return 6;
+    case Facet::SF: return 7;
+    case Facet::DF: return 10;
+    case Facet::OF: return 11;
+    default: assert(false && "invalid flag facet"); return 0;
+    }
+}
 
-llvm::Value* CallConv::Pack(RegFile& regfile, llvm::Value* val,
-                            std::vector<llvm::Value*>* store_insts) const {
+llvm::Value* CallConv::Pack(RegFile& regfile, const CpuStructLayout& layout,
+                            llvm::Value* val,
+                            std::vector<llvm::Value*>* store_insts,
+                            const RegSet* live_regs) const {
     llvm::IRBuilder<> irb(regfile.GetInsertBlock());
 
     llvm::Value* sptr = val;
@@ -83,57 +248,50 @@ llvm::Value* CallConv::Pack(RegFile& regfile, llvm::Value* val,
     if ((fn = llvm::dyn_cast<llvm::Function>(val)))
         sptr = &fn->arg_begin()[CpuStructParamIdx()];
 
+    const CallConvDesc& desc = GetDesc(*this);
     llvm::Value* ret_val = nullptr;
-    if (*this == CallConv::HHVM)
+    if (desc.ret_count > 0)
         ret_val = llvm::UndefValue::get(fn->getReturnType());
 
-    for (auto& entry : cpu_struct_entries) {
-        size_t offset; LLReg reg; Facet facet;
-        std::tie(offset, reg, facet) = entry;
+    // With packed flags, the written flags are combined and inserted into the
+    // flag word, all other bits of the word are preserved.
+    llvm::Value* flags_bits = nullptr;
+    uint64_t flags_mask = 0;
+
+    for (size_t i = 0; i < entry_count; i++) {
+        CpuStructLayout::Entry layout_entry; LLReg reg; Facet facet;
+        std::tie(layout_entry, reg, facet) = cpu_struct_entries[i];
+
+        // Dead registers are neither stored nor returned, their value in the
+        // CPU struct is unspecified after the function returns.
+        if (live_regs && !live_regs->Contains(reg, facet)) {
+            if (store_insts != nullptr)
+                store_insts->push_back(nullptr);
+            continue;
+        }
 
         llvm::Value* reg_val = regfile.GetReg(reg, facet);
 
         llvm::Value* store_inst = nullptr;
         bool store_in_sptr = true;
-        if (*this == CallConv::HHVM) {
-            int ins_idx = -1;
-            if (reg == LLReg(LL_RT_IP, 0))
-                ins_idx = 0; // RIP is stored in RBX
-            else if (reg == LLReg(LL_RT_GP64, 0))
-                ins_idx = 8; // RAX is stored in RAX
-            else if (reg == LLReg(LL_RT_GP64, 1))
-                ins_idx = 5; // RCX is stored in RCX
-            else if (reg == LLReg(LL_RT_GP64, 2))
-                ins_idx = 4; // RDX is stored in RDX
-            else if (reg == LLReg(LL_RT_GP64, 3))
-                ins_idx = 1; // RBX is stored in RBP
-            else if (reg == LLReg(LL_RT_GP64, 4))
-                ins_idx = 13; // RSP is stored in R15
-            else if (reg == LLReg(LL_RT_GP64, 5))
-                ins_idx = 11; // RBP is stored in R13
-            else if (reg == LLReg(LL_RT_GP64, 6))
-                ins_idx = 3; // RSI is stored in RSI
-            else if (reg == LLReg(LL_RT_GP64, 7))
-                ins_idx = 2; // RDI is stored in RDI
-            else if (reg == LLReg(LL_RT_GP64, 8))
-                ins_idx = 6; // R8 is stored in R8
-            else if (reg == LLReg(LL_RT_GP64, 9))
-                ins_idx = 7; // R9 is stored in R9
-            else if (reg == LLReg(LL_RT_GP64, 10))
-                ins_idx = 9; // R10 is stored in R10
-            else if (reg == LLReg(LL_RT_GP64, 11))
-                ins_idx = 10; // R11 is stored in R11
-
-            if (ins_idx >= 0) {
-                unsigned ins_idx_u = static_cast<unsigned>(ins_idx);
-                ret_val = irb.CreateInsertValue(ret_val, reg_val, {ins_idx_u});
-                store_in_sptr = false;
-            }
+        const EntrySlot& slot = desc.slots[i];
+        if (slot.ret >= 0) {
+            if (slot.facet != facet)
+                reg_val = irb.CreateBitCast(reg_val, Facet(slot.facet).Type(irb.getContext()));
+            unsigned ret_idx_u = static_cast<unsigned>(slot.ret);
+            ret_val = irb.CreateInsertValue(ret_val, reg_val, {ret_idx_u});
+            store_in_sptr = false;
+        } else if (layout.PackedFlags() && reg.rt == LL_RT_EFLAGS) {
+            llvm::Value* bit = irb.CreateZExt(reg_val, irb.getInt64Ty());
+            bit = irb.CreateShl(bit, FlagBit(facet));
+            flags_bits = flags_bits ? irb.CreateOr(flags_bits, bit) : bit;
+            flags_mask |= uint64_t{1} << FlagBit(facet);
+            store_in_sptr = false;
         }
 
         if (store_in_sptr) {
             llvm::Type* ptr_ty = facet.Type(irb.getContext())->getPointerTo();
-            llvm::Value* ptr = irb.CreateConstGEP1_64(sptr, offset);
+            llvm::Value* ptr = irb.CreateConstGEP1_64(sptr, layout.Offset(layout_entry));
             ptr = irb.CreatePointerCast(ptr, ptr_ty);
             store_inst = irb.CreateStore(reg_val, ptr);
         }
@@ -142,11 +300,21 @@ llvm::Value* CallConv::Pack(RegFile& regfile, llvm::Value* val,
             store_insts->push_back(store_inst);
     }
 
+    if (flags_bits != nullptr) {
+        llvm::Type* ptr_ty = irb.getInt64Ty()->getPointerTo();
+        llvm::Value* ptr = irb.CreateConstGEP1_64(sptr, layout.Offset(CpuStructLayout::EFLAGS));
+        ptr = irb.CreatePointerCast(ptr, ptr_ty);
+        llvm::Value* flags_word = irb.CreateLoad(ptr);
+        flags_word = irb.CreateAnd(flags_word, irb.getInt64(~flags_mask));
+        irb.CreateStore(irb.CreateOr(flags_word, flags_bits), ptr);
+    }
+
     return ret_val;
 }
 
-void CallConv::Unpack(RegFile& regfile, llvm::Value* val,
-                      std::vector<llvm::Value*>* loaded_vals) const {
+void CallConv::Unpack(RegFile& regfile, const CpuStructLayout& layout,
+                      llvm::Value* val,
+                      std::vector<llvm::Value*>* loaded_vals, bool lazy) const {
     llvm::IRBuilder<> irb(regfile.GetInsertBlock());
 
     llvm::Value* sptr = val;
@@ -154,52 +322,77 @@ void CallConv::Unpack(RegFile& regfile, llvm::Value* val,
     if ((fn = llvm::dyn_cast<llvm::Function>(val)))
         sptr = &fn->arg_begin()[CpuStructParamIdx()];
 
-    for (auto& entry : cpu_struct_entries) {
-        size_t offset; LLReg reg; Facet facet;
-        std::tie(offset, reg, facet) = entry;
+    const CallConvDesc& desc = GetDesc(*this);
+    if (lazy && loaded_vals != nullptr)
+        loaded_vals->assign(entry_count, nullptr);
+
+    // The packed flag word is loaded once and shared by all flags.
+    auto flags_word = std::make_shared<llvm::Value*>(nullptr);
+    size_t flags_offset = layout.Offset(CpuStructLayout::EFLAGS);
+
+    for (size_t i = 0; i < entry_count; i++) {
+        CpuStructLayout::Entry layout_entry; LLReg reg; Facet facet;
+        std::tie(layout_entry, reg, facet) = cpu_struct_entries[i];
 
         llvm::Value* reg_val = nullptr;
-        if (*this == CallConv::HHVM) {
-            int arg_idx = -1;
-            if (reg == LLReg(LL_RT_GP64, 0))
-                arg_idx = 10; // RAX is stored in RAX
-            else if (reg == LLReg(LL_RT_GP64, 1))
-                arg_idx = 7; // RCX is stored in RCX
-            else if (reg == LLReg(LL_RT_GP64, 2))
-                arg_idx = 6; // RDX is stored in RDX
-            else if (reg == LLReg(LL_RT_GP64, 3))
-                arg_idx = 2; // RBX is stored in RBP
-            else if (reg == LLReg(LL_RT_GP64, 4))
-                arg_idx = 3; // RSP is stored in R15
-            else if (reg == LLReg(LL_RT_GP64, 5))
-                arg_idx = 13; // RBP is stored in R13
-            else if (reg == LLReg(LL_RT_GP64, 6))
-                arg_idx = 5; // RSI is stored in RSI
-            else if (reg == LLReg(LL_RT_GP64, 7))
-                arg_idx = 4; // RDI is stored in RDI
-            else if (reg == LLReg(LL_RT_GP64, 8))
-                arg_idx = 8; // R8 is stored in R8
-            else if (reg == LLReg(LL_RT_GP64, 9))
-                arg_idx = 9; // R9 is stored in R9
-            else if (reg == LLReg(LL_RT_GP64, 10))
-                arg_idx = 11; // R10 is stored in R10
-            else if (reg == LLReg(LL_RT_GP64, 11))
-                arg_idx = 12; // R11 is stored in R11
-
-            if (arg_idx >= 0)
-                reg_val = &fn->arg_begin()[arg_idx];
+        const EntrySlot& slot = desc.slots[i];
+        if (slot.arg >= 0) {
+            reg_val = &fn->arg_begin()[slot.arg];
+            if (slot.facet != facet)
+                reg_val = irb.CreateBitCast(reg_val, facet.Type(irb.getContext()));
         }
 
-        if (reg_val == nullptr) {
-            llvm::Type* ptr_ty = facet.Type(irb.getContext())->getPointerTo();
-            llvm::Value* ptr = irb.CreateConstGEP1_64(sptr, offset);
-            reg_val = irb.CreateLoad(irb.CreatePointerCast(ptr, ptr_ty));
+        // Loads from packed flags are not recorded, as there is no matching
+        // store of the individual flag at exits.
+        bool packed_flag = layout.PackedFlags() && reg.rt == LL_RT_EFLAGS;
+        size_t offset = layout.Offset(layout_entry);
+        auto load_reg = [=](llvm::IRBuilder<>& load_irb) -> llvm::Value* {
+            llvm::LLVMContext& ctx = load_irb.getContext();
+            if (packed_flag) {
+                if (*flags_word == nullptr) {
+                    llvm::Type* ptr_ty = load_irb.getInt64Ty()->getPointerTo();
+                    llvm::Value* ptr = load_irb.CreateConstGEP1_64(sptr, flags_offset);
+                    ptr = load_irb.CreatePointerCast(ptr, ptr_ty);
+                    *flags_word = load_irb.CreateLoad(ptr);
+                }
+                llvm::Value* bit = load_irb.CreateLShr(*flags_word, FlagBit(facet));
+                return load_irb.CreateTrunc(bit, facet.Type(ctx));
+            }
+
+            llvm::Type* ptr_ty = facet.Type(ctx)->getPointerTo();
+            llvm::Value* ptr = load_irb.CreateConstGEP1_64(sptr, offset);
+            ptr = load_irb.CreatePointerCast(ptr, ptr_ty);
+            llvm::Value* load = load_irb.CreateLoad(ptr);
+            if (lazy && loaded_vals != nullptr)
+                (*loaded_vals)[i] = load;
+            return load;
+        };
+
+        if (reg_val == nullptr && lazy) {
+            // Like PHI nodes in other blocks, the load is only created when the
+            // register is actually used.
+            regfile.SetRegGenerator(reg, facet, [=, &regfile]() {
+                llvm::BasicBlock* block = regfile.GetInsertBlock();
+                llvm::IRBuilder<> lazy_irb(block);
+                if (llvm::Instruction* terminator = block->getTerminator())
+                    lazy_irb.SetInsertPoint(terminator);
+                return load_reg(lazy_irb);
+            });
+            continue;
         }
 
+        if (reg_val == nullptr)
+            reg_val = load_reg(irb);
+
         regfile.SetReg(reg, facet, reg_val, false);
 
-        if (loaded_vals != nullptr)
-            loaded_vals->push_back(reg_val);
+        if (loaded_vals == nullptr)
+            continue;
+        llvm::Value* mem_ref = packed_flag ? nullptr : reg_val;
+        if (lazy)
+            (*loaded_vals)[i] = mem_ref;
+        else
+            loaded_vals->push_back(mem_ref);
     }
 }
 
@@ -34,11 +34,58 @@
 namespace rellume {
 
 class RegFile;
+class RegSet;
+
+/// Offsets of the registers in the CPU struct. By default, this is the layout
+/// described in cpustruct.json, but embedders can select a different preset or
+/// change individual offsets at run time.
+class CpuStructLayout {
+public:
+    enum Entry {
+#define RELLUME_NAMED_REG(name,nameu,sz,off) nameu,
+#include <rellume/cpustruct-private.inc>
+#undef RELLUME_NAMED_REG
+        /// All flags in a single 64-bit word, bits at their EFLAGS position.
+        /// Only used instead of the individual flags if PackedFlags() is set.
+        EFLAGS,
+        NUM_ENTRIES
+    };
+
+    CpuStructLayout();
+    /// Layout with flags packed into a single word and the vector registers
+    /// in separate cache lines after the general purpose registers.
+    static CpuStructLayout Packed();
+
+    /// Look up an entry by its name in cpustruct.json, or "eflags" for the
+    /// packed flags. Returns NUM_ENTRIES for unknown names.
+    static Entry Lookup(const char* name);
+
+    size_t Offset(Entry entry) const {
+        return offsets[entry];
+    }
+    void SetOffset(Entry entry, size_t offset) {
+        offsets[entry] = offset;
+    }
+    bool PackedFlags() const {
+        return packed_flags;
+    }
+    void SetPackedFlags(bool packed) {
+        packed_flags = packed;
+    }
+
+    /// Size of the CPU struct up to the end of the last used entry.
+    size_t Size() const;
+
+private:
+    size_t offsets[NUM_ENTRIES];
+    bool packed_flags = false;
+};
 
 class CallConv {
 public:
+    /// Values correspond to the public LLCallConv enum.
     enum Value {
-        SPTR, HHVM,
+        SPTR, HHVM, SYSV, PRESERVE_ALL,
     };
 
     llvm::FunctionType* FnType(llvm::LLVMContext& ctx) const;
@@ -46,13 +93,22 @@ public:
     unsigned CpuStructParamIdx() const;
 
     // Pack values from regfile into the CPU struct. The return value for the
-    // function is returned (or NULL for void).
-    llvm::Value* Pack(RegFile& regfile, llvm::Value* val,
-                      std::vector<llvm::Value*>* sptr_access = nullptr) const;
+    // function is returned (or NULL for void). If live_regs is given, only
+    // these registers are stored; for skipped registers, a NULL entry is added
+    // to sptr_access.
+    llvm::Value* Pack(RegFile& regfile, const CpuStructLayout& layout,
+                      llvm::Value* val,
+                      std::vector<llvm::Value*>* sptr_access = nullptr,
+                      const RegSet* live_regs = nullptr) const;
     // Unpack values from val (usually the function) into the register file. For
-    // SPTR, val can also be the CPU struct pointer directly.
-    void Unpack(RegFile& regfile, llvm::Value* val,
-                std::vector<llvm::Value*>* sptr_access = nullptr) const;
+    // SPTR, val can also be the CPU struct pointer directly. If lazy is set,
+    // registers are loaded only when first used; the loads are inserted at the
+    // end of the current insert block, so this is only valid if the CPU struct
+    // is not modified before. sptr_access is then filled on demand.
+    void Unpack(RegFile& regfile, const CpuStructLayout& layout,
+                llvm::Value* val,
+                std::vector<llvm::Value*>* sptr_access = nullptr,
+                bool lazy = false) const;
 
     CallConv() = default;
     constexpr CallConv(Value value) : value(value) {}
@@ -62,14 +118,6 @@ private:
     Value value;
 };
 
-struct CpuStructOff {
-    enum {
-#define RELLUME_NAMED_REG(name,nameu,sz,off) nameu = off,
-#include <rellume/cpustruct-private.inc>
-#undef RELLUME_NAMED_REG
-    };
-};
-
 } // namespace
 
 #endif
@@ -28,6 +28,7 @@
 #include "rellume/instr.h"
 #include <cstdbool>
 #include <cstdint>
+#include <string>
 #include <unordered_map>
 
 
@@ -38,6 +39,21 @@ class Value;
 
 namespace rellume {
 
+/// Memory ordering model for lifted memory accesses and fences. The values
+/// correspond to the public LLMemoryModel enum.
+enum class MemoryModel {
+    /// Memory accesses are unordered, all fences are sequentially consistent.
+    DEFAULT = 0,
+    /// Model x86-TSO: general-purpose loads are acquire and stores are release
+    /// operations (or are ordered by fences if they may be misaligned), XCHG,
+    /// CMPXCHG and XADD on memory are surrounded by full fences and fences
+    /// have the strength of the original instruction.
+    TSO = 1,
+    /// The lifted code does not share memory with other threads, so fences
+    /// are omitted entirely.
+    SINGLE_THREADED = 2,
+};
+
 struct LLConfig {
     /// Enable the usage of overflow intrinsics instead of bitwise operations
     /// when setting the overflow flag. For dynamic values this leads to better
@@ -46,7 +62,8 @@ struct LLConfig {
     bool enableOverflowIntrinsics = false;
     /// Unsafe floating-point optimizations, corresponds to -ffast-math.
     bool enableFastMath = false;
-    /// Generate additional pointer facets using getelementptr for ADD/SUB/LEA.
+    /// Track pointer facets through ADD/SUB/XADD/LEA using getelementptr, and
+    /// through register moves and PUSH/POP of 64-bit registers.
     bool use_gep_ptr_arithmetic = false;
     /// Use pointer types for 64-bit reg-reg compares instead of ptrtoint.
     bool prefer_pointer_cmp = false;
@@ -56,9 +73,33 @@ struct LLConfig {
     bool use_native_segment_base = false;
     /// Verify the IR after lifting.
     bool verify_ir = false;
+    /// Replace accesses below the stack pointer on entry with an alloca, if
+    /// the frame does not escape. Memory below the stack pointer is not
+    /// written back when the function returns.
+    bool promote_stack = false;
+    /// Address stack accesses as constant offsets from the entry stack pointer
+    /// and add alias information for the stack frame.
+    bool track_stack = false;
+    /// Use a single type for all accesses to the same memory location.
+    bool unify_access_types = false;
+    /// Derive the alignment of memory accesses from dominating accesses with
+    /// the same base pointer.
+    bool propagate_alignment = false;
+    /// Memory ordering model used for loads, stores and fences.
+    MemoryModel memory_model = MemoryModel::DEFAULT;
+
+    /// Value of the "target-cpu" attribute of generated functions, or "host"
+    /// for the CPU of the host. Empty to omit the attribute.
+    std::string target_cpu;
+    /// Value of the "target-features" attribute of generated functions, e.g.
+    /// "+avx2,+bmi2", or "host" for the features of the host. Empty to omit
+    /// the attribute.
+    std::string target_features;
 
     /// Optimize generated IR for the HHVM calling convention.
     CallConv callconv = CallConv::SPTR;
+    /// Layout of the CPU struct.
+    CpuStructLayout cpu_layout;
 
     /// The global offset base
     uintptr_t global_base_addr = 0;
@@ -69,6 +110,26 @@ struct LLConfig {
     /// Overridden implementations for specific instruction. The function must
     /// take a pointer to the CPU state as a single argument.
     std::unordered_map<LLInstrType, llvm::Function*> instr_overrides;
+
+    /// Instrumentation hook called at the beginning of every basic block with
+    /// the block address, type void(i64). The hooks are called directly, so
+    /// they can be inlined by later optimizations.
+    llvm::Function* hook_block = nullptr;
+    /// Instrumentation hook called before every memory access with the
+    /// address, the access size in bytes and whether the access is a store,
+    /// type void(i8*, i64, i1).
+    llvm::Function* hook_mem_access = nullptr;
+    /// Instrumentation hook called before indirect jumps, calls and returns
+    /// with the instruction address and the target address, type
+    /// void(i64, i64).
+    llvm::Function* hook_indirect_branch = nullptr;
+
+    /// Pointer to an array of i64 execution counters, or NULL to disable
+    /// profiling. Every basic block and every edge of a conditional branch
+    /// gets one counter, the mapping is available from the lifted function.
+    /// Counters of each function start at its counter base (default 0); when
+    /// several functions share this array, give each a disjoint range.
+    llvm::Value* profile_counters = nullptr;
 };
 
 } // namespace
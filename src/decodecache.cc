@@ -0,0 +1,59 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#include "decodecache.h"
+
+#include "rellume/instr.h"
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+
+namespace rellume {
+
+bool DecodeCache::Lookup(uintptr_t addr, LLInstr* inst) {
+    std::lock_guard<std::mutex> guard(mutex);
+    auto it = instrs.find(addr);
+    if (it == instrs.end())
+        return false;
+    *inst = it->second;
+    return true;
+}
+
+void DecodeCache::Insert(const LLInstr& inst) {
+    std::lock_guard<std::mutex> guard(mutex);
+    instrs[inst.addr] = inst;
+}
+
+void DecodeCache::Invalidate(uintptr_t start, uintptr_t end) {
+    std::lock_guard<std::mutex> guard(mutex);
+    // Invalidation is rare compared to lookups, so a linear scan is fine.
+    for (auto it = instrs.begin(); it != instrs.end();) {
+        if (it->first < end && it->first + it->second.len > start)
+            it = instrs.erase(it);
+        else
+            ++it;
+    }
+}
+
+} // namespace
@@ -0,0 +1,64 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#ifndef LL_DECODE_CACHE_H
+#define LL_DECODE_CACHE_H
+
+#include "rellume/instr.h"
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+
+namespace rellume {
+
+/**
+ * \brief Cache of decoded instructions, shared between functions.
+ *
+ * All operations are thread-safe, so a single cache can be used when decoding
+ * functions in parallel. The cache assumes that code does not change unless
+ * the modified range is explicitly invalidated.
+ **/
+class DecodeCache
+{
+public:
+    DecodeCache() = default;
+
+    DecodeCache(const DecodeCache&) = delete;
+    DecodeCache& operator=(const DecodeCache&) = delete;
+
+    /// Look up the instruction at the given address. Returns false if the
+    /// address is not in the cache.
+    bool Lookup(uintptr_t addr, LLInstr* inst);
+    void Insert(const LLInstr& inst);
+    /// Remove all instructions which overlap with the range [start, end).
+    void Invalidate(uintptr_t start, uintptr_t end);
+
+private:
+    std::mutex mutex;
+    std::unordered_map<uintptr_t, LLInstr> instrs;
+};
+
+} // namespace
+
+#endif
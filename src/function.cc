@@ -27,16 +27,25 @@
 #include "callconv.h"
 #include "config.h"
 #include "lifter.h"
+#include "stackpromotion.h"
+#include "transforms.h"
 #include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/GlobalValue.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Support/Host.h>
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <memory>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 
 /**
@@ -48,6 +57,20 @@
 
 namespace rellume {
 
+static std::string HostCPUFeatures() {
+    llvm::StringMap<bool> host_features;
+    if (!llvm::sys::getHostCPUFeatures(host_features))
+        return "";
+
+    std::string features;
+    for (const auto& feature : host_features) {
+        if (!features.empty())
+            features += ",";
+        features += (feature.getValue() ? "+" : "-") + feature.getKey().str();
+    }
+    return features;
+}
+
 Function::Function(llvm::Module* mod, LLConfig* cfg) : cfg(cfg)
 {
     llvm::LLVMContext& ctx = mod->getContext();
@@ -61,7 +84,17 @@ Function::Function(llvm::Module* mod, LLConfig* cfg) : cfg(cfg)
     llvm->addParamAttr(cpu_param_idx, llvm::Attribute::NoAlias);
     llvm->addParamAttr(cpu_param_idx, llvm::Attribute::NoCapture);
     llvm->addParamAttr(cpu_param_idx, llvm::Attribute::getWithAlignment(ctx, 16));
-    llvm->addDereferenceableParamAttr(cpu_param_idx, 0x190);
+    llvm->addDereferenceableParamAttr(cpu_param_idx, cfg->cpu_layout.Size());
+
+    // Allow code generation for newer CPUs than the original code targets.
+    if (cfg->target_cpu == "host")
+        llvm->addFnAttr("target-cpu", llvm::sys::getHostCPUName());
+    else if (!cfg->target_cpu.empty())
+        llvm->addFnAttr("target-cpu", cfg->target_cpu);
+    if (cfg->target_features == "host")
+        llvm->addFnAttr("target-features", HostCPUFeatures());
+    else if (!cfg->target_features.empty())
+        llvm->addFnAttr("target-features", cfg->target_features);
 
     // Create entry basic block as first block in the function.
     entry_block = std::make_unique<ArchBasicBlock>(llvm, *cfg, BasicBlock::ENTRY);
@@ -69,22 +102,160 @@ Function::Function(llvm::Module* mod, LLConfig* cfg) : cfg(cfg)
 
 Function::~Function() = default;
 
+void Function::AddEntry(uint64_t addr)
+{
+    if (std::find(entry_addrs.begin(), entry_addrs.end(), addr) == entry_addrs.end())
+        entry_addrs.push_back(addr);
+}
+
 void Function::AddInst(uint64_t block_addr, const LLInstr& inst)
 {
-    if (block_map.size() == 0)
-        entry_addr = block_addr;
-    if (block_map.find(block_addr) == block_map.end())
+    // Instructions are usually added sequentially, so extend the last range.
+    if (!code_ranges.empty() && code_ranges.back().second == inst.addr)
+        code_ranges.back().second = inst.addr + inst.len;
+    else
+        code_ranges.push_back(std::make_pair(inst.addr, inst.addr + inst.len));
+
+    if (entry_addrs.empty())
+        entry_addrs.push_back(block_addr);
+    bool new_block = block_map.find(block_addr) == block_map.end();
+    if (new_block)
         block_map[block_addr] = std::make_unique<ArchBasicBlock>(llvm, *cfg);
 
+    if (new_block && cfg->profile_counters) {
+        size_t idx = counter_base + counter_count++;
+        block_counters[block_addr] = idx;
+        AddCounter(*block_map[block_addr], idx, nullptr);
+    }
+
+    // Only the last instruction of a block can be a return.
+    if (inst.type == LL_INS_RET)
+        ret_blocks.insert(block_addr);
+    else
+        ret_blocks.erase(block_addr);
+
     Lifter lifter(*cfg, *block_map[block_addr]);
+    if (new_block)
+        lifter.LiftBlockHook(block_addr);
     lifter.Lift(inst);
 }
 
+void Function::AddCounter(ArchBasicBlock& block, size_t idx, llvm::Value* inc) {
+    // Insert at the end of the current block, which is empty for a new block.
+    // PHI nodes are always inserted at the beginning, so this is fine.
+    llvm::IRBuilder<> irb(block.GetInsertBlock()->GetRegFile()->GetInsertBlock());
+    if (inc == nullptr)
+        inc = irb.getInt64(1);
+
+    llvm::Type* counter_ptr_ty = irb.getInt64Ty()->getPointerTo();
+    llvm::Value* ptr = irb.CreatePointerCast(cfg->profile_counters, counter_ptr_ty);
+    ptr = irb.CreateConstGEP1_64(ptr, idx);
+    irb.CreateStore(irb.CreateAdd(irb.CreateLoad(ptr), inc), ptr);
+}
+
+const std::vector<std::pair<uint64_t, uint64_t>>& Function::CodeRanges() {
+    std::sort(code_ranges.begin(), code_ranges.end());
+
+    // Merge overlapping and adjacent ranges.
+    size_t count = 0;
+    for (const auto& range : code_ranges) {
+        if (count > 0 && range.first <= code_ranges[count - 1].second) {
+            auto& last = code_ranges[count - 1];
+            last.second = std::max(last.second, range.second);
+        } else {
+            code_ranges[count++] = range;
+        }
+    }
+    code_ranges.resize(count);
+
+    return code_ranges;
+}
+
+int64_t Function::BlockCounter(uint64_t block_addr) const {
+    auto it = block_counters.find(block_addr);
+    return it != block_counters.end() ? it->second : -1;
+}
+
+int64_t Function::EdgeCounter(uint64_t from, uint64_t to) const {
+    auto it = edge_counters.find(std::make_pair(from, to));
+    return it != edge_counters.end() ? it->second : -1;
+}
+
+void Function::BranchProfile(uint64_t from, uint64_t true_addr,
+                             uint64_t false_addr, uint64_t* true_count,
+                             uint64_t* false_count) const {
+    auto true_it = edge_profile.find(std::make_pair(from, true_addr));
+    auto false_it = edge_profile.find(std::make_pair(from, false_addr));
+    if (true_it != edge_profile.end() || false_it != edge_profile.end()) {
+        *true_count = true_it != edge_profile.end() ? true_it->second : 0;
+        *false_count = false_it != edge_profile.end() ? false_it->second : 0;
+    } else {
+        *true_count = ProfileCount(true_addr);
+        *false_count = ProfileCount(false_addr);
+    }
+}
+
+llvm::MDNode* Function::BranchWeights(uint64_t from, llvm::Value* true_addr,
+                                      llvm::Value* false_addr) {
+    auto true_const = llvm::dyn_cast<llvm::ConstantInt>(true_addr);
+    auto false_const = llvm::dyn_cast<llvm::ConstantInt>(false_addr);
+    if ((profile.empty() && edge_profile.empty()) || !true_const || !false_const)
+        return nullptr;
+
+    uint64_t true_count, false_count;
+    BranchProfile(from, true_const->getZExtValue(), false_const->getZExtValue(),
+                  &true_count, &false_count);
+    if (true_count == 0 && false_count == 0)
+        return nullptr;
+
+    // Branch weights are 32-bit only, so scale down large counts.
+    uint64_t max_count = std::max(true_count, false_count);
+    uint64_t scale = max_count / UINT32_MAX + 1;
+    llvm::MDBuilder md_builder(llvm->getContext());
+    return md_builder.createBranchWeights(true_count / scale,
+                                          false_count / scale);
+}
+
+void Function::OrderBlocksByProfile() {
+    // Place hot blocks first, so that the likely path is mostly fall-through.
+    // The entry block has to remain the first block in the function.
+    std::vector<std::pair<uint64_t, ArchBasicBlock*>> blocks;
+    for (const auto& item : block_map)
+        blocks.push_back(std::make_pair(item.first, item.second.get()));
+    std::sort(blocks.begin(), blocks.end(), [this](const auto& a, const auto& b) {
+        uint64_t count_a = ProfileCount(a.first);
+        uint64_t count_b = ProfileCount(b.first);
+        return count_a != count_b ? count_a > count_b : a.first < b.first;
+    });
+
+    for (const auto& item : blocks)
+        item.second->MoveToEnd();
+    for (const auto& item : side_exit_map)
+        item.second->MoveToEnd();
+    exit_block->MoveToEnd();
+}
+
 ArchBasicBlock& Function::ResolveAddr(llvm::Value* addr) {
     if (auto const_addr = llvm::dyn_cast<llvm::ConstantInt>(addr)) {
-        auto block_it = block_map.find(const_addr->getZExtValue());
+        uint64_t target = const_addr->getZExtValue();
+        auto block_it = block_map.find(target);
         if (block_it != block_map.end())
             return *(block_it->second);
+
+        // Side exits store a constant RIP, which simplifies the exit code and
+        // avoids merging the state of unrelated exits.
+        if (side_exits) {
+            auto& side_exit = side_exit_map[target];
+            if (!side_exit) {
+                auto live_it = exit_live_out.find(target);
+                const RegSet& live_regs = live_it != exit_live_out.end() ?
+                                          live_it->second : live_out;
+                side_exit = std::make_unique<ArchBasicBlock>(llvm, *cfg,
+                                                             BasicBlock::EXIT,
+                                                             &live_regs, addr);
+            }
+            return *side_exit;
+        }
     }
     return *exit_block;
 }
@@ -93,16 +264,73 @@ llvm::Function* Function::Lift() {
     if (block_map.size() == 0)
         return nullptr;
 
-    exit_block = std::make_unique<ArchBasicBlock>(llvm, *cfg, BasicBlock::EXIT);
+    llvm::IntegerType* i64 = llvm::Type::getInt64Ty(llvm->getContext());
+    auto entry_rip = [i64](uint64_t addr) {
+        return llvm::ConstantInt::get(i64, addr);
+    };
+
+    exit_block = std::make_unique<ArchBasicBlock>(llvm, *cfg, BasicBlock::EXIT,
+                                                  &live_out);
 
-    entry_block->BranchTo(*block_map[entry_addr]);
+    if (entry_addrs.size() == 1) {
+        entry_block->BranchTo(ResolveAddr(entry_rip(entry_addrs[0])));
+    } else {
+        // Dispatch on the initial instruction pointer. Entries which were not
+        // decoded and unknown instruction pointers go to the exit immediately,
+        // leaving the CPU state unchanged.
+        std::vector<std::pair<uint64_t, ArchBasicBlock*>> cases;
+        for (uint64_t entry_addr : entry_addrs) {
+            ArchBasicBlock& target = ResolveAddr(entry_rip(entry_addr));
+            cases.push_back(std::make_pair(entry_addr, &target));
+        }
+        entry_block->BranchTo(entry_block->NextRip(), *exit_block, cases);
+    }
+
+    // Whether the function can only be left through a return instruction.
+    bool ret_exits_only = true;
+    auto is_exit = [this](llvm::Value* addr) {
+        auto const_addr = llvm::dyn_cast<llvm::ConstantInt>(addr);
+        return !const_addr || !block_map.count(const_addr->getZExtValue());
+    };
 
     for (auto it = block_map.begin(); it != block_map.end(); ++it) {
         llvm::Value* next_rip = it->second->NextRip();
+        if (!ret_blocks.count(it->first)) {
+            if (auto select = llvm::dyn_cast<llvm::SelectInst>(next_rip))
+                ret_exits_only &= !is_exit(select->getTrueValue()) &&
+                                  !is_exit(select->getFalseValue());
+            else
+                ret_exits_only &= !is_exit(next_rip);
+        }
         if (auto select = llvm::dyn_cast<llvm::SelectInst>(next_rip)) {
+            // Count both edges of the branch. As a block can have only one
+            // conditional branch, the count of the edge of an unconditional
+            // branch is equal to the block count.
+            auto true_addr = llvm::dyn_cast<llvm::ConstantInt>(select->getTrueValue());
+            auto false_addr = llvm::dyn_cast<llvm::ConstantInt>(select->getFalseValue());
+            if (cfg->profile_counters && true_addr && false_addr &&
+                    true_addr != false_addr) {
+                BasicBlock* block = it->second->GetInsertBlock();
+                llvm::IRBuilder<> irb(block->GetRegFile()->GetInsertBlock());
+                llvm::Value* cond = select->getCondition();
+                llvm::Value* taken = irb.CreateZExt(cond, irb.getInt64Ty());
+                llvm::Value* not_taken = irb.CreateSub(irb.getInt64(1), taken);
+
+                uint64_t true_val = true_addr->getZExtValue();
+                uint64_t false_val = false_addr->getZExtValue();
+                size_t idx = counter_base + counter_count;
+                edge_counters[std::make_pair(it->first, true_val)] = idx;
+                AddCounter(*it->second, idx, taken);
+                edge_counters[std::make_pair(it->first, false_val)] = idx + 1;
+                AddCounter(*it->second, idx + 1, not_taken);
+                counter_count += 2;
+            }
             it->second->BranchTo(select->getCondition(),
                                  ResolveAddr(select->getTrueValue()),
-                                 ResolveAddr(select->getFalseValue()));
+                                 ResolveAddr(select->getFalseValue()),
+                                 BranchWeights(it->first,
+                                               select->getTrueValue(),
+                                               select->getFalseValue()));
         } else {
             it->second->BranchTo(ResolveAddr(next_rip));
         }
@@ -117,10 +345,49 @@ llvm::Function* Function::Lift() {
         changed = false;
         for (auto& item : block_map)
             changed |= item.second->FillPhis();
+        for (auto& item : side_exit_map)
+            changed |= item.second->FillPhis();
         changed |= exit_block->FillPhis();
     }
 
     exit_block->RemoveUnmodifiedStores(*entry_block);
+    for (auto& item : side_exit_map)
+        item.second->RemoveUnmodifiedStores(*entry_block);
+
+    if (!profile.empty())
+        OrderBlocksByProfile();
+
+    // Pointer with the value of the stack pointer at the entry, if accesses
+    // were rebased onto it and the ABI alignment of the stack applies.
+    llvm::Value* stack_base = nullptr;
+    if (cfg->promote_stack || cfg->track_stack) {
+        // Requesting the stack pointer from the entry block materializes the
+        // load from the CPU struct, if it is not used otherwise.
+        RegFile* entry_regfile = entry_block->GetInsertBlock()->GetRegFile();
+        llvm::Value* entry_sp = entry_regfile->GetReg(LLReg(LL_RT_GP64, LL_RI_SP),
+                                                      Facet::I64);
+        // The frame is only dead at the exits if the function was entered at
+        // its start and left with a return. Otherwise, the red zone might be
+        // live across the boundaries of lifted blocks or traces, and
+        // registers might point into it on entry.
+        bool real_entry = whole_function && entry_addrs.size() == 1;
+        bool promoted = cfg->promote_stack && real_entry && ret_exits_only &&
+                        PromoteStack(llvm, entry_sp);
+        if (cfg->track_stack && !promoted) {
+            llvm::Value* base = RebaseStackAccesses(llvm, entry_sp, real_entry);
+            // At the real entry, the return address is at an address which
+            // is 8 modulo 16 according to the ABI.
+            if (real_entry)
+                stack_base = base;
+        }
+    }
+
+    // Run after the stack accesses are rewritten, which exposes constant
+    // offsets from a common base for locations on the stack.
+    if (cfg->unify_access_types)
+        UnifyAccessTypes(llvm);
+    if (cfg->propagate_alignment)
+        PropagateAlignment(llvm, stack_base);
 
     if (cfg->verify_ir && llvm::verifyFunction(*(llvm), &llvm::errs()))
         return nullptr;
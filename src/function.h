@@ -26,17 +26,23 @@
 
 #include "callconv.h"
 #include "config.h"
+#include "regfile.h"
 #include "rellume/instr.h"
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Value.h>
 #include <cstdint>
 #include <functional>
+#include <map>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 
 namespace rellume {
 
 class ArchBasicBlock;
+class DecodeCache;
 
 class Function
 {
@@ -50,9 +56,64 @@ public:
     Function(const Function&) = delete;
     Function& operator=(const Function&) = delete;
 
+    /// Add an additional entry point. With multiple entries, the lifted
+    /// function dispatches on the initial RIP value and returns immediately if
+    /// none matches. The start address of Decode is always an entry. If no
+    /// entry is added otherwise, the first added block is the only entry.
+    void AddEntry(uint64_t addr);
     void AddInst(uint64_t block_addr, const LLInstr& inst);
     llvm::Function* Lift();
 
+    /// Set the execution count of a block from a previous profiling run. Used
+    /// for branch weights and the block layout when lifting.
+    void SetProfile(uint64_t block_addr, uint64_t count) {
+        profile[block_addr] = count;
+    }
+    uint64_t ProfileCount(uint64_t block_addr) const {
+        auto it = profile.find(block_addr);
+        return it != profile.end() ? it->second : 0;
+    }
+    /// Set the execution count of the edge of a conditional branch from the
+    /// block at `from` to the address `to`, e.g. read from the edge counters
+    /// of a previous run. Used instead of the counts of the successor blocks,
+    /// which also include executions coming from other blocks.
+    void SetEdgeProfile(uint64_t from, uint64_t to, uint64_t count) {
+        edge_profile[std::make_pair(from, to)] = count;
+    }
+    /// Get the counts of both edges of a conditional branch. Edge counts are
+    /// used if any is known, otherwise block counts are an approximation.
+    void BranchProfile(uint64_t from, uint64_t true_addr, uint64_t false_addr,
+                       uint64_t* true_count, uint64_t* false_count) const;
+
+    /// Set the registers which are live when the function exits. Stores of
+    /// other registers to the CPU struct are omitted. By default, all
+    /// registers are live.
+    void SetLiveOut(const RegSet& regs) {
+        live_out = regs;
+    }
+    /// Set the live registers for the side exit to a specific address only,
+    /// overriding the function-wide set. Only used in trace mode.
+    void SetLiveOut(uint64_t target, const RegSet& regs) {
+        exit_live_out[target] = regs;
+    }
+
+    /// Number of profile counters used by the function. Edge counters are only
+    /// assigned during Lift().
+    size_t CounterCount() const {
+        return counter_count;
+    }
+    /// Set the index of the first counter of this function in the profile
+    /// counter array, so that several functions can share one array. Must be
+    /// called before decoding. Counter indices returned below are absolute.
+    void SetCounterBase(size_t base) {
+        counter_base = base;
+    }
+    /// Index of the execution counter of a block, or -1 if there is none.
+    int64_t BlockCounter(uint64_t block_addr) const;
+    /// Index of the counter for the edge of a conditional branch from the
+    /// block at `from` to the address `to`, or -1 if there is none.
+    int64_t EdgeCounter(uint64_t from, uint64_t to) const;
+
     // Implemented in lldecoder.cc
     enum class DecodeStop {
 #define RELLUME_DECODE_STOP(name,val) name = val,
@@ -60,18 +121,56 @@ public:
 #undef RELLUME_DECODE_STOP
     };
     using MemReader = std::function<size_t(uintptr_t, uint8_t*, size_t)>;
-    int Decode(uintptr_t addr, DecodeStop stop, MemReader memacc = nullptr);
+    int Decode(uintptr_t addr, DecodeStop stop, MemReader memacc = nullptr,
+               DecodeCache* cache = nullptr);
+
+    /// Sorted list of non-overlapping address ranges [start, end) of the
+    /// instructions contained in the function. If the code in one of these
+    /// ranges is modified, the lifted function must be discarded.
+    const std::vector<std::pair<uint64_t, uint64_t>>& CodeRanges();
+    /// Compute a checksum over the bytes in the given ranges, suitable for
+    /// cheaply checking whether code was modified since lifting.
+    static uint64_t CodeChecksum(const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+                                 MemReader memacc = nullptr);
 
 private:
     ArchBasicBlock& ResolveAddr(llvm::Value* addr);
+    void AddCounter(ArchBasicBlock& block, size_t idx, llvm::Value* inc);
+    llvm::MDNode* BranchWeights(uint64_t from, llvm::Value* true_addr,
+                                llvm::Value* false_addr);
+    void OrderBlocksByProfile();
 
     LLConfig* cfg;
 
     llvm::Function* llvm;
-    uint64_t entry_addr;
+    std::vector<uint64_t> entry_addrs;
     std::unique_ptr<ArchBasicBlock> entry_block;
     std::unique_ptr<ArchBasicBlock> exit_block;
     std::unordered_map<uint64_t,std::unique_ptr<ArchBasicBlock>> block_map;
+
+    /// Whether the function was decoded completely from its entry, i.e. not
+    /// only a block, superblock or trace.
+    bool whole_function = false;
+    /// Blocks ending with a return instruction.
+    std::unordered_set<uint64_t> ret_blocks;
+
+    /// Whether branches to constant addresses outside of the function get a
+    /// separate exit block each, instead of sharing the common exit block.
+    bool side_exits = false;
+    std::unordered_map<uint64_t,std::unique_ptr<ArchBasicBlock>> side_exit_map;
+
+    RegSet live_out = RegSet::All();
+    std::unordered_map<uint64_t, RegSet> exit_live_out;
+
+    size_t counter_base = 0;
+    size_t counter_count = 0;
+    std::unordered_map<uint64_t, size_t> block_counters;
+    std::map<std::pair<uint64_t, uint64_t>, size_t> edge_counters;
+
+    std::unordered_map<uint64_t, uint64_t> profile;
+    std::map<std::pair<uint64_t, uint64_t>, uint64_t> edge_profile;
+
+    std::vector<std::pair<uint64_t, uint64_t>> code_ranges;
 };
 
 }
@@ -250,6 +250,20 @@ end_ops:
     case FDI_TZCNT: llinst.type = LL_INS_TZCNT; break;
     case FDI_BSR: llinst.type = LL_INS_BSR; break;
     case FDI_LZCNT: llinst.type = LL_INS_LZCNT; break;
+    case FDI_POPCNT: llinst.type = LL_INS_POPCNT; break;
+    case FDI_ANDN: llinst.type = LL_INS_ANDN; break;
+    case FDI_BLSR: llinst.type = LL_INS_BLSR; break;
+    case FDI_BLSI: llinst.type = LL_INS_BLSI; break;
+    case FDI_BLSMSK: llinst.type = LL_INS_BLSMSK; break;
+    case FDI_SHLX: llinst.type = LL_INS_SHLX; break;
+    case FDI_SHRX: llinst.type = LL_INS_SHRX; break;
+    case FDI_SARX: llinst.type = LL_INS_SARX; break;
+    case FDI_RORX: llinst.type = LL_INS_RORX; break;
+    case FDI_MULX: llinst.type = LL_INS_MULX; break;
+    case FDI_ADCX: llinst.type = LL_INS_ADCX; break;
+    case FDI_ADOX: llinst.type = LL_INS_ADOX; break;
+    case FDI_PDEP: llinst.type = LL_INS_PDEP; break;
+    case FDI_PEXT: llinst.type = LL_INS_PEXT; break;
     case FDI_BT: llinst.type = LL_INS_BT; break;
     case FDI_BT_IMM: llinst.type = LL_INS_BT; break;
     case FDI_BTC: llinst.type = LL_INS_BTC; break;
@@ -478,6 +492,13 @@ end_ops:
     case FDI_SSE_PMOVMSKB: llinst.type = LL_INS_PMOVMSKB; break;
     case FDI_SSE_MOVMSKPS: llinst.type = LL_INS_MOVMSKPS; break;
     case FDI_SSE_MOVMSKPD: llinst.type = LL_INS_MOVMSKPD; break;
+    case FDI_SSE_AESENC: llinst.type = LL_INS_AESENC; break;
+    case FDI_SSE_AESENCLAST: llinst.type = LL_INS_AESENCLAST; break;
+    case FDI_SSE_AESDEC: llinst.type = LL_INS_AESDEC; break;
+    case FDI_SSE_AESDECLAST: llinst.type = LL_INS_AESDECLAST; break;
+    case FDI_SSE_AESIMC: llinst.type = LL_INS_AESIMC; break;
+    case FDI_SSE_AESKEYGENASSIST: llinst.type = LL_INS_AESKEYGENASSIST; break;
+    case FDI_SSE_PCLMULQDQ: llinst.type = LL_INS_PCLMULQDQ; break;
     case FDI_JMP: llinst.type = LL_INS_JMP; break;
     case FDI_JMP_IND: llinst.type = LL_INS_JMP; break;
     case FDI_JO: llinst.type = LL_INS_JO; break;
@@ -0,0 +1,85 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#include "instrstream.h"
+
+#include "rellume/instr.h"
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace rellume {
+
+void InstrStream::Push(const LLInstr& inst) {
+    assert(inst.operand_count >= 0 && inst.operand_count <= 4);
+
+    addrs.push_back(inst.addr);
+    types.push_back(inst.type);
+    lens.push_back(inst.len);
+    operand_sizes.push_back(inst.operand_size);
+    address_sizes.push_back(inst.address_size);
+    op_starts.push_back(ops.size());
+
+    for (int i = 0; i < inst.operand_count; i++) {
+        const LLInstrOp& op = inst.ops[i];
+        PackedOp packed;
+        packed.val = op.val;
+        packed.reg = op.reg;
+        packed.ireg = op.ireg;
+        packed.type = op.type;
+        packed.scale = op.scale;
+        packed.seg = op.seg;
+        packed.addrsize = op.addrsize;
+        packed.size = op.size;
+        ops.push_back(packed);
+    }
+}
+
+LLInstr InstrStream::Get(size_t idx) const {
+    LLInstr inst{};
+    inst.type = Type(idx);
+    inst.addr = addrs[idx];
+    inst.len = lens[idx];
+    inst.operand_size = operand_sizes[idx];
+    inst.address_size = address_sizes[idx];
+
+    size_t op_end = idx + 1 < op_starts.size() ? op_starts[idx + 1] : ops.size();
+    inst.operand_count = op_end - op_starts[idx];
+    for (int i = 0; i < inst.operand_count; i++) {
+        const PackedOp& packed = ops[op_starts[idx] + i];
+        LLInstrOp& op = inst.ops[i];
+        op.val = packed.val;
+        op.reg = packed.reg;
+        op.ireg = packed.ireg;
+        op.type = packed.type;
+        op.scale = packed.scale;
+        op.seg = packed.seg;
+        op.addrsize = packed.addrsize;
+        op.size = packed.size;
+    }
+
+    return inst;
+}
+
+} // namespace
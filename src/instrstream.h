@@ -0,0 +1,89 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#ifndef LL_INSTR_STREAM_H
+#define LL_INSTR_STREAM_H
+
+#include "rellume/instr.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace rellume {
+
+/**
+ * \brief Compact storage for a sequence of decoded instructions.
+ *
+ * Instructions are stored as structure-of-arrays: the fields used for
+ * control flow analysis (address, length, type) are kept in separate dense
+ * arrays and only the operands which are actually present are stored in a
+ * packed form. A full LLInstr is only materialized when it gets lifted.
+ **/
+class InstrStream
+{
+public:
+    InstrStream() = default;
+
+    size_t Size() const {
+        return addrs.size();
+    }
+    uintptr_t Addr(size_t idx) const {
+        return addrs[idx];
+    }
+    unsigned Len(size_t idx) const {
+        return lens[idx];
+    }
+    LLInstrType Type(size_t idx) const {
+        return static_cast<LLInstrType>(types[idx]);
+    }
+
+    void Push(const LLInstr& inst);
+    LLInstr Get(size_t idx) const;
+
+private:
+    struct PackedOp {
+        uint64_t val;
+        LLReg reg;
+        LLReg ireg;
+        uint8_t type;
+        uint8_t scale;
+        uint8_t seg;
+        uint8_t addrsize;
+        uint8_t size;
+    };
+
+    std::vector<uintptr_t> addrs;
+    std::vector<uint16_t> types;
+    std::vector<uint8_t> lens;
+    std::vector<uint8_t> operand_sizes;
+    std::vector<uint8_t> address_sizes;
+    /// Index of the first operand in ops, the operand count is the difference
+    /// to the start index of the next instruction.
+    std::vector<uint32_t> op_starts;
+    std::vector<PackedOp> ops;
+};
+
+} // namespace
+
+#endif
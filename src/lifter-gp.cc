@@ -28,8 +28,14 @@
 #include "rellume/instr.h"
 #include <llvm/IR/Instruction.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
+#if LL_LLVM_MAJOR >= 10
+#include <llvm/IR/IntrinsicsX86.h>
+#endif
 #include <llvm/IR/Value.h>
 #include <llvm/Transforms/Utils/Cloning.h>
+#include <algorithm>
+#include <cassert>
 
 
 /**
@@ -73,6 +79,16 @@ void Lifter::Lift(const LLInstr& inst) {
     }
 }
 
+void Lifter::LiftBlockHook(uint64_t block_addr) {
+    if (cfg.hook_block != nullptr)
+        irb.CreateCall(cfg.hook_block, {irb.getInt64(block_addr)});
+}
+
+void Lifter::CallIndirectBranchHook(const LLInstr& inst, llvm::Value* target) {
+    if (cfg.hook_indirect_branch != nullptr)
+        irb.CreateCall(cfg.hook_indirect_branch, {irb.getInt64(inst.addr), target});
+}
+
 void Lifter::LiftOverride(const LLInstr& inst, llvm::Function* override) {
     if (inst.type == LL_INS_SYSCALL) {
         SetReg(LLReg(LL_RT_GP64, LL_RI_C), Facet::I64,
@@ -86,10 +102,10 @@ void Lifter::LiftOverride(const LLInstr& inst, llvm::Function* override) {
 
     // Pack all state into the CPU struct.
     CallConv sptr_conv = CallConv::SPTR;
-    sptr_conv.Pack(*regfile, mem_arg);
+    sptr_conv.Pack(*regfile, cfg.cpu_layout, mem_arg);
     llvm::CallInst* call = irb.CreateCall(call_type, override, {mem_arg});
     regfile->InitAll(nullptr); // Clear all facets before importing register state
-    sptr_conv.Unpack(*regfile, mem_arg);
+    sptr_conv.Unpack(*regfile, cfg.cpu_layout, mem_arg);
 
     // Directly inline alwaysinline functions
     if (override->hasFnAttribute(llvm::Attribute::AlwaysInline)) {
@@ -99,26 +115,69 @@ void Lifter::LiftOverride(const LLInstr& inst, llvm::Function* override) {
 }
 
 void Lifter::LiftMovgp(const LLInstr& inst, llvm::Instruction::CastOps cast) {
-    // TODO: if the instruction moves the whole register, keep all facets.
-    // TODO: implement this for all register-register moves.
+    // If the instruction moves the whole register, keep all facets, including
+    // the pointer facet.
+    if (inst.ops[0].type == LL_OP_REG && inst.ops[1].type == LL_OP_REG &&
+            inst.ops[0].size == 8 && inst.ops[1].size == 8) {
+        regfile->CopyReg(inst.ops[0].reg, inst.ops[1].reg);
+        return;
+    }
 
     llvm::Value* val = OpLoad(inst.ops[1], Facet::I);
     llvm::Type* tgt_ty = irb.getIntNTy(inst.ops[0].size*8);
     OpStoreGp(inst.ops[0], irb.CreateCast(cast, val, tgt_ty));
 }
 
+void Lifter::LiftMovnti(const LLInstr& inst) {
+    llvm::Value* val = OpLoad(inst.ops[1], Facet::I);
+    OpStoreGp(inst.ops[0], val, ALIGN_NONE, /*nontemporal=*/true);
+}
+
+void Lifter::LiftPush(const LLInstr& inst) {
+    // Store pointers to the stack to keep the provenance for the POP.
+    if (cfg.use_gep_ptr_arithmetic && inst.ops[0].type == LL_OP_REG &&
+            inst.ops[0].size == 8) {
+        StackPush(GetReg(inst.ops[0].reg, Facet::PTR));
+        return;
+    }
+
+    StackPush(OpLoad(inst.ops[0], Facet::I));
+}
+
+void Lifter::LiftPop(const LLInstr& inst) {
+    if (cfg.use_gep_ptr_arithmetic && inst.ops[0].type == LL_OP_REG &&
+            inst.ops[0].size == 8) {
+        llvm::Value* ptr = StackPop(LLReg(LL_RT_GP64, LL_RI_SP),
+                                    irb.getInt8PtrTy());
+        SetReg(inst.ops[0].reg, Facet::I64,
+               irb.CreatePtrToInt(ptr, irb.getInt64Ty()));
+        SetRegFacet(inst.ops[0].reg, Facet::PTR, ptr);
+        return;
+    }
+
+    OpStoreGp(inst.ops[0], StackPop());
+}
+
+llvm::Value* Lifter::AddPointerFacet(const LLInstrOp& op1, const LLInstrOp& op2,
+                                     llvm::Value* op1_val, llvm::Value* op2_val) {
+    // Use the operand which is known to be a pointer as base, so that the
+    // GEP keeps the provenance. Otherwise, assume the destination is the base.
+    if (!HasPointerProvenance(op1) && HasPointerProvenance(op2))
+        return irb.CreateGEP(GetReg(op2.reg, Facet::PTR), op1_val);
+    return irb.CreateGEP(GetReg(op1.reg, Facet::PTR), op2_val);
+}
+
 void Lifter::LiftAdd(const LLInstr& inst) {
     llvm::Value* op1 = OpLoad(inst.ops[0], Facet::I);
     llvm::Value* op2 = OpLoad(inst.ops[1], Facet::I);
     llvm::Value* res = irb.CreateAdd(op1, op2);
 
     // Compute pointer facet for 64-bit additions stored in a register.
-    // TODO: handle case where the original pointer is the second operand.
     if (cfg.use_gep_ptr_arithmetic && inst.ops[0].type == LL_OP_REG &&
             inst.ops[0].size == 8) {
-        llvm::Value* op1_ptr = GetReg(inst.ops[0].reg, Facet::PTR);
+        llvm::Value* res_ptr = AddPointerFacet(inst.ops[0], inst.ops[1], op1, op2);
         SetReg(inst.ops[0].reg, Facet::I64, res);
-        SetRegFacet(inst.ops[0].reg, Facet::PTR, irb.CreateGEP(op1_ptr, op2));
+        SetRegFacet(inst.ops[0].reg, Facet::PTR, res_ptr);
     } else {
         // We cannot use this outside of the if-clause, otherwise we would
         // clobber the pointer facet of the source operand.
@@ -150,13 +209,26 @@ void Lifter::LiftAdc(const LLInstr& inst) {
 }
 
 void Lifter::LiftXadd(const LLInstr& inst) {
+    FenceLocked(inst.ops[0]);
     llvm::Value* op1 = OpLoad(inst.ops[0], Facet::I);
     llvm::Value* op2 = OpLoad(inst.ops[1], Facet::I);
     llvm::Value* res = irb.CreateAdd(op1, op2);
 
-    // TODO: generate pointer facets?
-    OpStoreGp(inst.ops[0], res);
-    OpStoreGp(inst.ops[1], op1);
+    if (cfg.use_gep_ptr_arithmetic && inst.ops[0].type == LL_OP_REG &&
+            inst.ops[0].size == 8) {
+        llvm::Value* op1_ptr = GetReg(inst.ops[0].reg, Facet::PTR);
+        llvm::Value* res_ptr = AddPointerFacet(inst.ops[0], inst.ops[1], op1, op2);
+        // The source is written first, the destination takes precedence if
+        // both operands are the same register.
+        SetReg(inst.ops[1].reg, Facet::I64, op1);
+        SetRegFacet(inst.ops[1].reg, Facet::PTR, op1_ptr);
+        SetReg(inst.ops[0].reg, Facet::I64, res);
+        SetRegFacet(inst.ops[0].reg, Facet::PTR, res_ptr);
+    } else {
+        OpStoreGp(inst.ops[0], res);
+        OpStoreGp(inst.ops[1], op1);
+    }
+    FenceLocked(inst.ops[0]);
 
     FlagCalcZ(res);
     FlagCalcS(res);
@@ -171,8 +243,8 @@ void Lifter::LiftSub(const LLInstr& inst) {
     llvm::Value* op2 = OpLoad(inst.ops[1], Facet::I);
     llvm::Value* res = irb.CreateSub(op1, op2);
 
-    // Compute pointer facet for 64-bit additions stored in a register.
-    // TODO: handle case where the original pointer is the second operand.
+    // Compute pointer facet for 64-bit subtractions stored in a register. If
+    // the second operand is the pointer, the result is not a pointer.
     if (cfg.use_gep_ptr_arithmetic && inst.ops[0].type == LL_OP_REG &&
             inst.ops[0].size == 8) {
         llvm::Value* op1_ptr = GetReg(inst.ops[0].reg, Facet::PTR);
@@ -230,6 +302,7 @@ void Lifter::LiftCmp(const LLInstr& inst) {
 }
 
 void Lifter::LiftCmpxchg(const LLInstr& inst) {
+    FenceLocked(inst.ops[0]);
     auto acc = OpLoad(LLInstrOp(LLReg::Gp(inst.ops[0].size, LL_RI_A)), Facet::I);
     auto dst = OpLoad(inst.ops[0], Facet::I);
     auto src = OpLoad(inst.ops[1], Facet::I);
@@ -247,14 +320,23 @@ void Lifter::LiftCmpxchg(const LLInstr& inst) {
     OpStoreGp(inst.ops[0], irb.CreateSelect(GetFlag(Facet::ZF), src, dst));
     // ACC gets the value from memory.
     OpStoreGp(LLInstrOp(LLReg::Gp(inst.ops[0].size, LL_RI_A)), dst);
+    FenceLocked(inst.ops[0]);
 }
 
 void Lifter::LiftXchg(const LLInstr& inst) {
+    if (inst.ops[0].type == LL_OP_REG && inst.ops[1].type == LL_OP_REG &&
+            inst.ops[0].size == 8) {
+        regfile->SwapReg(inst.ops[0].reg, inst.ops[1].reg);
+        return;
+    }
+
     // TODO: atomic memory operation
+    FenceLocked(inst.ops[0]);
     llvm::Value* op1 = OpLoad(inst.ops[0], Facet::I);
     llvm::Value* op2 = OpLoad(inst.ops[1], Facet::I);
     OpStoreGp(inst.ops[0], op2);
     OpStoreGp(inst.ops[1], op1);
+    FenceLocked(inst.ops[0]);
 }
 
 void Lifter::LiftAndOrXor(const LLInstr& inst, llvm::Instruction::BinaryOps op,
@@ -585,6 +667,210 @@ void Lifter::LiftBitscan(const LLInstr& inst, bool trailing) {
     SetFlagUndef({Facet::OF, Facet::SF, Facet::AF, Facet::PF, Facet::CF});
 }
 
+void Lifter::LiftBitcount(const LLInstr& inst, llvm::Intrinsic::ID id) {
+    llvm::Value* src = OpLoad(inst.ops[1], Facet::I);
+    llvm::Value* res;
+    if (id == llvm::Intrinsic::ctpop) {
+        res = CreateUnaryIntrinsic(id, src);
+    } else {
+        // Unlike BSF/BSR, the result for a zero source is the operand size,
+        // which is exactly the defined behavior of the LLVM intrinsics.
+        res = irb.CreateBinaryIntrinsic(id, src, /*zero_undef=*/irb.getFalse());
+    }
+    OpStoreGp(inst.ops[0], res);
+
+    if (id == llvm::Intrinsic::ctpop) {
+        FlagCalcZ(src);
+        SetFlag(Facet::OF, irb.getFalse());
+        SetFlag(Facet::SF, irb.getFalse());
+        SetFlag(Facet::AF, irb.getFalse());
+        SetFlag(Facet::PF, irb.getFalse());
+        SetFlag(Facet::CF, irb.getFalse());
+    } else {
+        FlagCalcZ(res);
+        auto zero = llvm::Constant::getNullValue(src->getType());
+        SetFlag(Facet::CF, irb.CreateICmpEQ(src, zero));
+        SetFlagUndef({Facet::OF, Facet::SF, Facet::AF, Facet::PF});
+    }
+}
+
+void Lifter::LiftAndn(const LLInstr& inst) {
+    llvm::Value* op1 = OpLoad(inst.ops[1], Facet::I);
+    llvm::Value* op2 = OpLoad(inst.ops[2], Facet::I);
+    llvm::Value* res = irb.CreateAnd(irb.CreateNot(op1), op2);
+    OpStoreGp(inst.ops[0], res);
+
+    FlagCalcZ(res);
+    FlagCalcS(res);
+    SetFlag(Facet::OF, irb.getFalse());
+    SetFlag(Facet::CF, irb.getFalse());
+    SetFlagUndef({Facet::AF, Facet::PF});
+}
+
+void Lifter::LiftBls(const LLInstr& inst) {
+    llvm::Value* src = OpLoad(inst.ops[1], Facet::I);
+    llvm::Value* zero = llvm::Constant::getNullValue(src->getType());
+    llvm::Value* dec = irb.CreateSub(src, llvm::ConstantInt::get(src->getType(), 1));
+    llvm::Value* res;
+    if (inst.type == LL_INS_BLSR) {
+        res = irb.CreateAnd(src, dec);
+        FlagCalcZ(res);
+        SetFlag(Facet::CF, irb.CreateICmpEQ(src, zero));
+    } else if (inst.type == LL_INS_BLSI) {
+        res = irb.CreateAnd(src, irb.CreateNeg(src));
+        FlagCalcZ(res);
+        SetFlag(Facet::CF, irb.CreateICmpNE(src, zero));
+    } else { // LL_INS_BLSMSK
+        res = irb.CreateXor(src, dec);
+        SetFlag(Facet::ZF, irb.getFalse());
+        SetFlag(Facet::CF, irb.CreateICmpEQ(src, zero));
+    }
+    OpStoreGp(inst.ops[0], res);
+
+    FlagCalcS(res);
+    SetFlag(Facet::OF, irb.getFalse());
+    SetFlagUndef({Facet::AF, Facet::PF});
+}
+
+void Lifter::LiftShiftx(const LLInstr& inst, llvm::Instruction::BinaryOps op) {
+    llvm::Value* src = OpLoad(inst.ops[1], Facet::I);
+    llvm::Value* shift = OpLoad(inst.ops[2], Facet::I);
+    // The count is masked like for SHL/SHR/SAR, so it is never out of range.
+    unsigned mask = inst.ops[0].size == 8 ? 0x3f : 0x1f;
+    shift = irb.CreateAnd(shift, mask);
+    OpStoreGp(inst.ops[0], irb.CreateBinOp(op, src, shift));
+    // Flags are unaffected.
+}
+
+void Lifter::LiftRorx(const LLInstr& inst) {
+    llvm::Value* src = OpLoad(inst.ops[1], Facet::I);
+    llvm::Type* ty = src->getType();
+    unsigned mask = inst.ops[0].size == 8 ? 0x3f : 0x1f;
+    llvm::Value* shift = llvm::ConstantInt::get(ty, inst.ops[2].val & mask);
+
+    llvm::Module* module = irb.GetInsertBlock()->getModule();
+    auto intrinsic = llvm::Intrinsic::getDeclaration(module,
+                                                     llvm::Intrinsic::fshr,
+                                                     {ty});
+    OpStoreGp(inst.ops[0], irb.CreateCall(intrinsic, {src, src, shift}));
+    // Flags are unaffected.
+}
+
+void Lifter::LiftMulx(const LLInstr& inst) {
+    llvm::Value* op1 = OpLoad(LLInstrOp(LLReg::Gp(inst.ops[0].size, LL_RI_D)), Facet::I);
+    llvm::Value* op2 = OpLoad(inst.ops[2], Facet::I);
+
+    llvm::Type* value_ty = op1->getType();
+    llvm::Type* double_ty = irb.getIntNTy(inst.ops[0].size*8 * 2);
+    llvm::Value* ext_res = irb.CreateMul(irb.CreateZExt(op1, double_ty),
+                                         irb.CreateZExt(op2, double_ty));
+    llvm::Value* low = irb.CreateTrunc(ext_res, value_ty);
+    llvm::Value* high = irb.CreateLShr(ext_res, inst.ops[0].size*8);
+    high = irb.CreateTrunc(high, value_ty);
+
+    // If both destinations are the same register, it gets the high half.
+    OpStoreGp(inst.ops[1], low);
+    OpStoreGp(inst.ops[0], high);
+    // Flags are unaffected.
+}
+
+void Lifter::LiftAdx(const LLInstr& inst, Facet flag) {
+    llvm::Value* op1 = OpLoad(inst.ops[0], Facet::I);
+    llvm::Value* op2 = OpLoad(inst.ops[1], Facet::I);
+    llvm::Value* carry = irb.CreateZExt(GetFlag(flag), op1->getType());
+    llvm::Value* sum = irb.CreateAdd(op1, op2);
+    llvm::Value* res = irb.CreateAdd(sum, carry);
+    OpStoreGp(inst.ops[0], res);
+
+    // Only the carry flag of the chain (CF for ADCX, OF for ADOX) is written.
+    llvm::Value* carry1 = irb.CreateICmpULT(sum, op1);
+    llvm::Value* carry2 = irb.CreateICmpULT(res, sum);
+    SetFlag(flag, irb.CreateOr(carry1, carry2));
+}
+
+void Lifter::LiftPdepPext(const LLInstr& inst) {
+    llvm::Value* src = OpLoad(inst.ops[1], Facet::I);
+    llvm::Value* mask = OpLoad(inst.ops[2], Facet::I);
+    bool deposit = inst.type == LL_INS_PDEP;
+    unsigned sz = inst.ops[0].size * 8;
+
+    if (HasTargetFeature("bmi2")) {
+        llvm::Intrinsic::ID id;
+        if (deposit)
+            id = sz == 64 ? llvm::Intrinsic::x86_bmi_pdep_64
+                          : llvm::Intrinsic::x86_bmi_pdep_32;
+        else
+            id = sz == 64 ? llvm::Intrinsic::x86_bmi_pext_64
+                          : llvm::Intrinsic::x86_bmi_pext_32;
+        llvm::Module* module = irb.GetInsertBlock()->getModule();
+        auto intrinsic = llvm::Intrinsic::getDeclaration(module, id);
+        OpStoreGp(inst.ops[0], irb.CreateCall(intrinsic, {src, mask}));
+        return;
+    }
+
+    // Without BMI2, walk over the set bits of the mask, lowest first, and
+    // move one bit from/to the next contiguous position of the source.
+    llvm::Type* ty = src->getType();
+    llvm::Value* zero = llvm::Constant::getNullValue(ty);
+    llvm::Value* res = zero;
+    for (unsigned i = 0; i < sz; i++) {
+        llvm::Value* lowest = irb.CreateAnd(mask, irb.CreateNeg(mask));
+        llvm::Value* bit = llvm::ConstantInt::get(ty, uint64_t{1} << i);
+        llvm::Value* test = irb.CreateAnd(src, deposit ? bit : lowest);
+        llvm::Value* set = irb.CreateICmpNE(test, zero);
+        res = irb.CreateOr(res, irb.CreateSelect(set, deposit ? lowest : bit, zero));
+        mask = irb.CreateXor(mask, lowest);
+    }
+    OpStoreGp(inst.ops[0], res);
+    // Flags are unaffected.
+}
+
+void Lifter::LiftCrc32(const LLInstr& inst) {
+    llvm::Value* crc = OpLoad(inst.ops[0], Facet::I);
+    llvm::Value* src = OpLoad(inst.ops[1], Facet::I);
+    unsigned src_size = inst.ops[1].size * 8;
+    crc = irb.CreateTrunc(crc, irb.getInt32Ty());
+
+    llvm::Value* res;
+    if (HasTargetFeature("sse4.2")) {
+        llvm::Intrinsic::ID id;
+        switch (src_size) {
+        case 8: id = llvm::Intrinsic::x86_sse42_crc32_32_8; break;
+        case 16: id = llvm::Intrinsic::x86_sse42_crc32_32_16; break;
+        case 32: id = llvm::Intrinsic::x86_sse42_crc32_32_32; break;
+        case 64: id = llvm::Intrinsic::x86_sse42_crc32_64_64; break;
+        default: assert(false && "invalid crc32 operand size"); return;
+        }
+        llvm::Module* module = irb.GetInsertBlock()->getModule();
+        auto intrinsic = llvm::Intrinsic::getDeclaration(module, id);
+        if (src_size == 64)
+            crc = irb.CreateZExt(crc, irb.getInt64Ty());
+        res = irb.CreateCall(intrinsic, {crc, src});
+        res = irb.CreateTrunc(res, irb.getInt32Ty());
+    } else {
+        // Bitwise CRC-32C (Castagnoli) in reflected bit order, least
+        // significant bit first, processed in chunks of at most 32 bits.
+        llvm::Value* poly = irb.getInt32(0x82f63b78);
+        llvm::Value* one = irb.getInt32(1);
+        res = crc;
+        for (unsigned off = 0; off < src_size; off += 32) {
+            llvm::Value* chunk = irb.CreateLShr(src, off);
+            unsigned chunk_size = std::min(src_size - off, 32u);
+            chunk = irb.CreateTrunc(chunk, irb.getIntNTy(chunk_size));
+            res = irb.CreateXor(res, irb.CreateZExt(chunk, irb.getInt32Ty()));
+            for (unsigned i = 0; i < chunk_size; i++) {
+                llvm::Value* mask = irb.CreateNeg(irb.CreateAnd(res, one));
+                res = irb.CreateXor(irb.CreateLShr(res, one),
+                                    irb.CreateAnd(mask, poly));
+            }
+        }
+    }
+
+    llvm::Type* dst_ty = irb.getIntNTy(inst.ops[0].size * 8);
+    OpStoreGp(inst.ops[0], irb.CreateZExt(res, dst_ty));
+    // Flags are unaffected.
+}
+
 void Lifter::LiftBittest(const LLInstr& inst) {
     llvm::Value* index = OpLoad(inst.ops[1], Facet::I);
     unsigned op_size = inst.ops[0].size * 8;
@@ -602,7 +888,10 @@ void Lifter::LiftBittest(const LLInstr& inst) {
             llvm::Value* off = irb.CreateAShr(index, __builtin_ctz(op_size));
             addr = irb.CreateGEP(addr, irb.CreateSExt(off, irb.getInt64Ty()));
         }
-        val = irb.CreateLoad(addr);
+        CallMemAccessHook(addr, addr->getType()->getPointerElementType(), false);
+        llvm::LoadInst* load = irb.CreateLoad(addr);
+        OrderMemAccess(load);
+        val = load;
     }
 
     // Truncated here because memory operand may need full value.
@@ -623,8 +912,10 @@ void Lifter::LiftBittest(const LLInstr& inst) {
 
     if (inst.ops[0].type == LL_OP_REG)
         OpStoreGp(inst.ops[0], val);
-    else // LL_OP_MEM
-        irb.CreateStore(val, addr);
+    else { // LL_OP_MEM
+        CallMemAccessHook(addr, val->getType(), true);
+        OrderMemAccess(irb.CreateStore(val, addr));
+    }
 
 skip_writeback:
     // Zero flag is not modified
@@ -646,7 +937,10 @@ void Lifter::LiftBswap(const LLInstr& inst) {
 void Lifter::LiftJmp(const LLInstr& inst) {
     LLInstrOp op = inst.ops[0];
     op.seg = LL_RI_None; // Force default segment, 3e is notrack.
-    SetReg(LLReg(LL_RT_IP, 0), Facet::I64, OpLoad(op, Facet::I64));
+    llvm::Value* new_rip = OpLoad(op, Facet::I64);
+    if (op.type != LL_OP_IMM)
+        CallIndirectBranchHook(inst, new_rip);
+    SetReg(LLReg(LL_RT_IP, 0), Facet::I64, new_rip);
 }
 
 void Lifter::LiftJcc(const LLInstr& inst, Condition cond) {
@@ -695,6 +989,8 @@ void Lifter::LiftCall(const LLInstr& inst) {
     LLInstrOp op = inst.ops[0];
     op.seg = LL_RI_None; // Force default segment, 3e is notrack.
     llvm::Value* new_rip = OpLoad(op, Facet::I);
+    if (op.type != LL_OP_IMM)
+        CallIndirectBranchHook(inst, new_rip);
     StackPush(GetReg(LLReg(LL_RT_IP, 0), Facet::I64));
     SetReg(LLReg(LL_RT_IP, 0), Facet::I64, new_rip);
 }
@@ -704,7 +1000,9 @@ void Lifter::LiftRet(const LLInstr& inst) {
         SetFlagUndef({Facet::OF, Facet::SF, Facet::ZF, Facet::AF, Facet::PF,
                       Facet::CF});
 
-    OpStoreGp(LLInstrOp(LLReg(LL_RT_IP, 0)), StackPop());
+    llvm::Value* new_rip = StackPop();
+    CallIndirectBranchHook(inst, new_rip);
+    OpStoreGp(LLInstrOp(LLReg(LL_RT_IP, 0)), new_rip);
 }
 
 LifterBase::RepInfo LifterBase::RepBegin() {
@@ -753,7 +1051,8 @@ void Lifter::LiftStos(const LLInstr& inst) {
 
     // TODO: optimize REP STOSB and other sizes with constant zero to llvm
     // memset intrinsic.
-    irb.CreateStore(src, dst_ptr);
+    CallMemAccessHook(dst_ptr, src->getType(), true);
+    OrderMemAccess(irb.CreateStore(src, dst_ptr));
     dst_ptr = irb.CreateGEP(dst_ptr, adj);
 
     dst_ptr = irb.CreatePointerCast(dst_ptr, irb.getInt8PtrTy());
@@ -781,7 +1080,11 @@ void Lifter::LiftMovs(const LLInstr& inst) {
 
     // TODO: optimize REP MOVSB and other sizes with constant zero to llvm
     // memcpy intrinsic.
-    irb.CreateStore(irb.CreateLoad(src_ptr), dst_ptr);
+    CallMemAccessHook(src_ptr, mov_ty, false);
+    llvm::LoadInst* val = irb.CreateLoad(src_ptr);
+    OrderMemAccess(val);
+    CallMemAccessHook(dst_ptr, mov_ty, true);
+    OrderMemAccess(irb.CreateStore(val, dst_ptr));
     src_ptr = irb.CreateGEP(src_ptr, adj);
     dst_ptr = irb.CreateGEP(dst_ptr, adj);
 
@@ -813,7 +1116,9 @@ void Lifter::LiftScas(const LLInstr& inst) {
 
     LLInstrOp src_op = LLInstrOp(LLReg::Gp(inst.operand_size, LL_RI_A));
     llvm::Value* src = OpLoad(src_op, Facet::I);
-    llvm::Value* dst = irb.CreateLoad(dst_ptr);
+    CallMemAccessHook(dst_ptr, mov_ty, false);
+    llvm::LoadInst* dst = irb.CreateLoad(dst_ptr);
+    OrderMemAccess(dst);
     // Perform a normal CMP operation.
     llvm::Value* res = irb.CreateSub(src, dst);
     SetFlag(Facet::ZF, irb.CreateICmpEQ(src, dst));
@@ -850,8 +1155,12 @@ void Lifter::LiftCmps(const LLInstr& inst) {
     llvm::Value* df = GetFlag(Facet::DF);
     llvm::Value* adj = irb.CreateSelect(df, irb.getInt64(-1), irb.getInt64(1));
 
-    llvm::Value* op1 = irb.CreateLoad(src_ptr);
-    llvm::Value* op2 = irb.CreateLoad(dst_ptr);
+    CallMemAccessHook(src_ptr, mov_ty, false);
+    llvm::LoadInst* op1 = irb.CreateLoad(src_ptr);
+    OrderMemAccess(op1);
+    CallMemAccessHook(dst_ptr, mov_ty, false);
+    llvm::LoadInst* op2 = irb.CreateLoad(dst_ptr);
+    OrderMemAccess(op2);
     // Perform a normal CMP operation.
     llvm::Value* res = irb.CreateSub(op1, op2);
     SetFlag(Facet::ZF, irb.CreateICmpEQ(op1, op2));
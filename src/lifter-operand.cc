@@ -26,9 +26,14 @@
 #include "callconv.h"
 #include "facet.h"
 #include "rellume/instr.h"
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Metadata.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
 #include <llvm-c/Core.h>
@@ -61,6 +66,21 @@ LifterBase::OpAddrConst(uint64_t addr, llvm::PointerType* ptr_ty)
     return irb.CreateIntToPtr(irb.getInt64(addr), ptr_ty);
 }
 
+llvm::Value*
+LifterBase::SegmentBase(int seg)
+{
+    size_t off = cfg.cpu_layout.Offset(seg == LL_RI_FS ? CpuStructLayout::FSBASE
+                                                       : CpuStructLayout::GSBASE);
+
+    unsigned struct_param_idx = cfg.callconv.CpuStructParamIdx();
+    llvm::Function* fn = irb.GetInsertBlock()->getParent();
+    llvm::Value* buf_ptr = &fn->arg_begin()[struct_param_idx];
+    llvm::Type* ptr_ty = irb.getInt64Ty()->getPointerTo();
+    llvm::Value* ptr = irb.CreateConstGEP1_64(buf_ptr, off);
+    ptr = irb.CreatePointerCast(ptr, ptr_ty);
+    return irb.CreateLoad(ptr);
+}
+
 llvm::Value*
 LifterBase::OpAddr(const LLInstrOp& op, llvm::Type* element_type)
 {
@@ -82,21 +102,10 @@ LifterBase::OpAddr(const LLInstrOp& op, llvm::Type* element_type)
 
         int addrspace = 0;
         if (op.seg == LL_RI_FS || op.seg == LL_RI_GS) {
-            if (cfg.use_native_segment_base) {
+            if (cfg.use_native_segment_base)
                 addrspace = op.seg == LL_RI_FS ? 257 : 256;
-            } else {
-                unsigned off = op.seg == LL_RI_FS ? CpuStructOff::FSBASE
-                                                  : CpuStructOff::GSBASE;
-
-                unsigned struct_param_idx = cfg.callconv.CpuStructParamIdx();
-                llvm::Function* fn = irb.GetInsertBlock()->getParent();
-                llvm::Value* buf_ptr = &fn->arg_begin()[struct_param_idx];
-                llvm::Type* ptr_ty = irb.getInt64Ty()->getPointerTo();
-                llvm::Value* ptr = irb.CreateConstGEP1_64(buf_ptr, off);
-                ptr = irb.CreatePointerCast(ptr, ptr_ty);
-
-                res = irb.CreateAdd(res, irb.CreateLoad(ptr));
-            }
+            else
+                res = irb.CreateAdd(res, SegmentBase(op.seg));
         }
 
         res = irb.CreateZExt(res, irb.getInt64Ty());
@@ -169,14 +178,26 @@ ll_operand_set_alignment(llvm::Instruction* value, Alignment alignment, bool sse
 {
     if (alignment == ALIGN_IMP)
         alignment = sse ? ALIGN_MAX : ALIGN_NONE;
+    // The maximum alignment is the size of the accessed value.
     if (llvm::LoadInst* load = llvm::dyn_cast<llvm::LoadInst>(value))
-        load->setAlignment(alignment == ALIGN_NONE ? 1 : load->getPointerOperandType()->getPrimitiveSizeInBits() / 8);
+        load->setAlignment(alignment == ALIGN_NONE ? 1 : load->getType()->getPrimitiveSizeInBits() / 8);
     else if (llvm::StoreInst* store = llvm::dyn_cast<llvm::StoreInst>(value))
-        store->setAlignment(alignment == ALIGN_NONE ? 1 : store->getPointerOperandType()->getPrimitiveSizeInBits() / 8);
+        store->setAlignment(alignment == ALIGN_NONE ? 1 : store->getValueOperand()->getType()->getPrimitiveSizeInBits() / 8);
+}
+
+static void
+ll_operand_set_nontemporal(llvm::Instruction* value)
+{
+    // The metadata must be a single i32 one.
+    llvm::LLVMContext& ctx = value->getContext();
+    llvm::Type* i32 = llvm::Type::getInt32Ty(ctx);
+    llvm::Metadata* one = llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(i32, 1));
+    value->setMetadata(llvm::LLVMContext::MD_nontemporal, llvm::MDNode::get(ctx, one));
 }
 
 llvm::Value*
-LifterBase::OpLoad(const LLInstrOp& op, Facet facet, Alignment alignment)
+LifterBase::OpLoad(const LLInstrOp& op, Facet facet, Alignment alignment,
+                   bool nontemporal)
 {
     facet = facet.Resolve(op.size * 8);
     if (op.type == LL_OP_IMM)
@@ -194,9 +215,14 @@ LifterBase::OpLoad(const LLInstrOp& op, Facet facet, Alignment alignment)
     {
         llvm::Type* type = facet.Type(irb.getContext());
         llvm::Value* addr = OpAddr(op, type);
+        CallMemAccessHook(addr, type, false);
         llvm::LoadInst* result = irb.CreateLoad(type, addr);
-        // FIXME: forward SSE information to increase alignment.
-        ll_operand_set_alignment(result, alignment, false);
+        // Full-width SSE memory operands must be aligned, unless they are
+        // accessed with MOVUPS and similar instructions.
+        ll_operand_set_alignment(result, alignment, op.size == 16);
+        OrderMemAccess(result);
+        if (nontemporal)
+            ll_operand_set_nontemporal(result);
         return result;
     }
 
@@ -205,13 +231,20 @@ LifterBase::OpLoad(const LLInstrOp& op, Facet facet, Alignment alignment)
 }
 
 void
-LifterBase::OpStoreGp(const LLInstrOp& op, llvm::Value* value, Alignment alignment)
+LifterBase::OpStoreGp(const LLInstrOp& op, llvm::Value* value, Alignment alignment,
+                      bool nontemporal)
 {
     if (op.type == LL_OP_MEM)
     {
         llvm::Value* addr = OpAddr(op, value->getType());
+        CallMemAccessHook(addr, value->getType(), true);
         llvm::StoreInst* store = irb.CreateStore(value, addr);
         ll_operand_set_alignment(store, alignment);
+        // Non-temporal stores are weakly ordered, even under x86-TSO.
+        if (nontemporal)
+            ll_operand_set_nontemporal(store);
+        else
+            OrderMemAccess(store);
         return;
     }
 
@@ -265,13 +298,17 @@ LifterBase::OpStoreGp(const LLInstrOp& op, llvm::Value* value, Alignment alignme
 
 void
 LifterBase::OpStoreVec(const LLInstrOp& op, llvm::Value* value, bool avx,
-                        Alignment alignment)
+                        Alignment alignment, bool nontemporal)
 {
     if (op.type == LL_OP_MEM)
     {
         llvm::Value* addr = OpAddr(op, value->getType());
+        CallMemAccessHook(addr, value->getType(), true);
         llvm::StoreInst* store = irb.CreateStore(value, addr);
-        ll_operand_set_alignment(store, alignment, !avx);
+        bool sse = !avx && value->getType()->getPrimitiveSizeInBits() == 128;
+        ll_operand_set_alignment(store, alignment, sse);
+        if (nontemporal)
+            ll_operand_set_nontemporal(store);
         return;
     }
 
@@ -342,7 +379,8 @@ void LifterBase::StackPush(llvm::Value* value) {
     llvm::Value* rsp = GetReg(LLReg(LL_RT_GP64, LL_RI_SP), Facet::PTR);
     rsp = irb.CreatePointerCast(rsp, value->getType()->getPointerTo());
     rsp = irb.CreateConstGEP1_64(rsp, -1);
-    irb.CreateStore(value, rsp);
+    CallMemAccessHook(rsp, value->getType(), true);
+    OrderMemAccess(irb.CreateStore(value, rsp));
 
     rsp = irb.CreatePointerCast(rsp, irb.getInt8PtrTy());
     llvm::Value* rsp_int = irb.CreatePtrToInt(rsp, irb.getInt64Ty());
@@ -350,9 +388,12 @@ void LifterBase::StackPush(llvm::Value* value) {
     SetRegFacet(LLReg(LL_RT_GP64, LL_RI_SP), Facet::PTR, rsp);
 }
 
-llvm::Value* LifterBase::StackPop(const LLReg sp_src_reg) {
+llvm::Value* LifterBase::StackPop(const LLReg sp_src_reg, llvm::Type* type) {
+    if (type == nullptr)
+        type = irb.getInt64Ty();
+
     llvm::Value* rsp = GetReg(sp_src_reg, Facet::PTR);
-    rsp = irb.CreatePointerCast(rsp, irb.getInt64Ty()->getPointerTo());
+    rsp = irb.CreatePointerCast(rsp, type->getPointerTo());
 
     llvm::Value* new_rsp = irb.CreateConstGEP1_64(rsp, 1);
     new_rsp = irb.CreatePointerCast(new_rsp, irb.getInt8PtrTy());
@@ -360,7 +401,111 @@ llvm::Value* LifterBase::StackPop(const LLReg sp_src_reg) {
     SetReg(LLReg(LL_RT_GP64, LL_RI_SP), Facet::I64, new_rsp_int);
     SetRegFacet(LLReg(LL_RT_GP64, LL_RI_SP), Facet::PTR, new_rsp);
 
-    return irb.CreateLoad(rsp);
+    CallMemAccessHook(rsp, type, false);
+    llvm::LoadInst* value = irb.CreateLoad(rsp);
+    OrderMemAccess(value);
+    return value;
+}
+
+void LifterBase::OrderMemAccess(llvm::Instruction* access) {
+    if (cfg.memory_model != MemoryModel::TSO)
+        return;
+
+    // Under x86-TSO, general-purpose loads have acquire and stores have release
+    // semantics. LLVM requires atomic accesses to be naturally aligned, so
+    // accesses which may be misaligned keep their alignment and are ordered by
+    // a fence after the load or before the store instead.
+    llvm::Type* type;
+    unsigned alignment;
+    if (llvm::LoadInst* load = llvm::dyn_cast<llvm::LoadInst>(access)) {
+        type = load->getType();
+        alignment = load->getAlignment();
+    } else if (llvm::StoreInst* store = llvm::dyn_cast<llvm::StoreInst>(access)) {
+        type = store->getValueOperand()->getType();
+        alignment = store->getAlignment();
+    } else {
+        return;
+    }
+
+    // Only general-purpose accesses are ordered; SSE operands (also as i128)
+    // are not single-copy atomic on x86 anyway.
+    const llvm::DataLayout& dl = access->getModule()->getDataLayout();
+    unsigned size = dl.getTypeStoreSize(type);
+    if ((!type->isIntegerTy() && !type->isPointerTy()) || size > 8)
+        return;
+
+    // An unspecified alignment is the ABI alignment, i.e. the natural one.
+    bool aligned = alignment == 0 || alignment >= size;
+    if (llvm::LoadInst* load = llvm::dyn_cast<llvm::LoadInst>(access)) {
+        if (aligned) {
+            load->setAlignment(size);
+            load->setAtomic(llvm::AtomicOrdering::Acquire);
+        } else {
+            auto fence = new llvm::FenceInst(irb.getContext(),
+                                             llvm::AtomicOrdering::Acquire);
+            fence->insertAfter(load);
+        }
+    } else if (llvm::StoreInst* store = llvm::dyn_cast<llvm::StoreInst>(access)) {
+        if (aligned) {
+            store->setAlignment(size);
+            store->setAtomic(llvm::AtomicOrdering::Release);
+        } else {
+            new llvm::FenceInst(irb.getContext(), llvm::AtomicOrdering::Release,
+                                llvm::SyncScope::System, store);
+        }
+    }
+}
+
+void LifterBase::FenceLocked(const LLInstrOp& op) {
+    // Locked instructions are full barriers under x86-TSO. Callers emit this
+    // before and after the memory access.
+    if (cfg.memory_model == MemoryModel::TSO && op.type == LL_OP_MEM)
+        irb.CreateFence(llvm::AtomicOrdering::SequentiallyConsistent);
+}
+
+bool LifterBase::HasPointerProvenance(const LLInstrOp& op) {
+    if (op.type != LL_OP_REG || op.size != 8)
+        return false;
+    // Don't materialize the facet, which would add a PHI node in blocks other
+    // than the entry. Such a facet is not known to be a pointer anyway.
+    llvm::Value* ptr = regfile->PeekReg(op.reg, Facet::PTR);
+    return ptr != nullptr && !llvm::isa<llvm::IntToPtrInst>(ptr);
+}
+
+void LifterBase::CallMemAccessHook(llvm::Value* addr, llvm::Type* type,
+                                   bool store) {
+    if (cfg.hook_mem_access == nullptr)
+        return;
+
+    // Segment-relative addresses live in a different address space. The hook
+    // gets the linear address, so add the segment base from the CPU struct.
+    llvm::Value* ptr;
+    unsigned addrspace = addr->getType()->getPointerAddressSpace();
+    if (addrspace == 256 || addrspace == 257) {
+        llvm::Value* linear = irb.CreatePtrToInt(addr, irb.getInt64Ty());
+        linear = irb.CreateAdd(linear, SegmentBase(addrspace == 257 ? LL_RI_FS
+                                                                    : LL_RI_GS));
+        ptr = irb.CreateIntToPtr(linear, irb.getInt8PtrTy());
+    } else {
+        ptr = irb.CreatePointerCast(addr, irb.getInt8PtrTy());
+    }
+    const llvm::DataLayout& dl = irb.GetInsertBlock()->getModule()->getDataLayout();
+    llvm::Value* size = irb.getInt64(dl.getTypeStoreSize(type));
+    irb.CreateCall(cfg.hook_mem_access, {ptr, size, irb.getInt1(store)});
+}
+
+bool LifterBase::HasTargetFeature(llvm::StringRef feature) {
+    llvm::Function* fn = irb.GetInsertBlock()->getParent();
+    llvm::Attribute attr = fn->getFnAttribute("target-features");
+    if (!attr.isStringAttribute())
+        return false;
+
+    llvm::SmallVector<llvm::StringRef, 32> features;
+    attr.getValueAsString().split(features, ',', -1, /*KeepEmpty=*/false);
+    for (llvm::StringRef item : features)
+        if (item.consume_front("+") && item == feature)
+            return true;
+    return false;
 }
 
 } // namespace
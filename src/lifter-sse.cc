@@ -25,9 +25,19 @@
 
 #include "facet.h"
 #include "rellume/instr.h"
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
+#if LL_LLVM_MAJOR >= 10
+#include <llvm/IR/IntrinsicsX86.h>
+#endif
+#include <llvm/IR/Module.h>
 #include <llvm/IR/Value.h>
 #include <algorithm>
+#include <cassert>
+#include <cstdint>
 
 
 
@@ -41,8 +51,20 @@
 namespace rellume {
 
 void Lifter::LiftFence(const LLInstr& inst) {
-    // TODO: distinguish also lfence and sfence.
-    irb.CreateFence(llvm::AtomicOrdering::SequentiallyConsistent);
+    if (cfg.memory_model == MemoryModel::SINGLE_THREADED)
+        return;
+
+    auto ordering = llvm::AtomicOrdering::SequentiallyConsistent;
+    if (cfg.memory_model == MemoryModel::TSO) {
+        // Loads and stores are already ordered under TSO, so LFENCE and SFENCE
+        // only need to keep loads resp. stores from being moved across. Only
+        // MFENCE orders earlier stores with later loads.
+        if (inst.type == LL_INS_LFENCE)
+            ordering = llvm::AtomicOrdering::Acquire;
+        else if (inst.type == LL_INS_SFENCE)
+            ordering = llvm::AtomicOrdering::Release;
+    }
+    irb.CreateFence(ordering);
 }
 
 void Lifter::LiftPrefetch(const LLInstr& inst, unsigned rw, unsigned locality) {
@@ -60,6 +82,7 @@ void Lifter::LiftFxsave(const LLInstr& inst) {
     llvm::Value* buf = OpAddr(inst.ops[0], irb.getInt8Ty());
     llvm::Module* mod = irb.GetInsertBlock()->getModule();
     irb.CreateAlignmentAssumption(mod->getDataLayout(), buf, 16);
+    CallMemAccessHook(buf, llvm::ArrayType::get(irb.getInt8Ty(), 512), true);
 
     // Zero FPU status
     // TODO: FCW=0x37f, MXCSR=0x1f80, MXCSR_MASK=0xffff
@@ -75,6 +98,7 @@ void Lifter::LiftFxrstor(const LLInstr& inst) {
     llvm::Value* buf = OpAddr(inst.ops[0], irb.getInt8Ty());
     llvm::Module* mod = irb.GetInsertBlock()->getModule();
     irb.CreateAlignmentAssumption(mod->getDataLayout(), buf, 16);
+    CallMemAccessHook(buf, llvm::ArrayType::get(irb.getInt8Ty(), 512), false);
 
     for (unsigned i = 0; i < 16; i++) {
         llvm::Value* ptr = irb.CreateConstGEP1_32(buf, 0xa0 + 0x10*i);
@@ -104,6 +128,8 @@ void Lifter::LiftSseMovq(const LLInstr& inst, Facet type)
         llvm::Value* zero = llvm::Constant::getNullValue(vector_ty);
         llvm::Value* zext = irb.CreateInsertElement(zero, op1, 0ul);
         OpStoreVec(inst.ops[0], zext);
+        // Keep the scalar facet to avoid an extractelement when moving back.
+        SetRegFacet(inst.ops[0].reg, type, op1);
     } else {
         OpStoreGp(inst.ops[0], op1);
     }
@@ -123,8 +149,18 @@ void Lifter::LiftSseMovScalar(const LLInstr& inst, Facet facet) {
 }
 
 void Lifter::LiftSseMovdq(const LLInstr& inst, Facet facet,
-                           Alignment alignment) {
-    OpStoreVec(inst.ops[0], OpLoad(inst.ops[1], facet, alignment), alignment);
+                           Alignment alignment, bool nontemporal) {
+#if LL_VECTOR_REGISTER_SIZE == 128
+    // Register moves overwrite the entire register, so keep all facets.
+    if (inst.ops[0].type == LL_OP_REG && inst.ops[1].type == LL_OP_REG) {
+        regfile->CopyReg(inst.ops[0].reg, inst.ops[1].reg);
+        return;
+    }
+#endif
+
+    // Only one of the operands is in memory, which gets the hint.
+    llvm::Value* value = OpLoad(inst.ops[1], facet, alignment, nontemporal);
+    OpStoreVec(inst.ops[0], value, /*avx=*/false, alignment, nontemporal);
 }
 
 void Lifter::LiftSseMovlp(const LLInstr& inst) {
@@ -517,6 +553,225 @@ void Lifter::LiftSseMovmsk(const LLInstr& inst, Facet op_type) {
     OpStoreGp(inst.ops[0], irb.CreateZExt(bits, irb.getInt64Ty()));
 }
 
+static const uint8_t aes_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+static const uint8_t aes_inv_sbox[256] = {
+    0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
+    0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
+    0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
+    0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
+    0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
+    0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
+    0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
+    0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
+    0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
+    0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
+    0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
+    0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
+    0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
+    0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
+    0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
+    0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d,
+};
+
+/// Get the (inverse) S-box as a constant global of the module.
+static llvm::GlobalVariable* AesSboxTable(llvm::Module* module, bool inverse) {
+    const char* name = inverse ? "rellume_aes_inv_sbox" : "rellume_aes_sbox";
+    if (llvm::GlobalVariable* table = module->getNamedGlobal(name))
+        return table;
+    llvm::ArrayRef<uint8_t> data(inverse ? aes_inv_sbox : aes_sbox);
+    llvm::Constant* init = llvm::ConstantDataArray::get(module->getContext(),
+                                                        data);
+    return new llvm::GlobalVariable(*module, init->getType(), /*const=*/true,
+                                    llvm::GlobalValue::InternalLinkage, init,
+                                    name);
+}
+
+static llvm::Value* AesSubBytes(llvm::IRBuilder<>& irb, llvm::Value* state,
+                                bool inverse) {
+    llvm::Module* module = irb.GetInsertBlock()->getModule();
+    llvm::Value* table = AesSboxTable(module, inverse);
+    llvm::Value* res = llvm::UndefValue::get(state->getType());
+    for (unsigned i = 0; i < 16; i++) {
+        llvm::Value* idx = irb.CreateExtractElement(state, i);
+        idx = irb.CreateZExt(idx, irb.getInt64Ty());
+        llvm::Value* ptr = irb.CreateGEP(table, {irb.getInt64(0), idx});
+        res = irb.CreateInsertElement(res, irb.CreateLoad(ptr), i);
+    }
+    return res;
+}
+
+/// Byte 4*c+r of the state holds row r of column c.
+static llvm::Value* AesShiftRows(llvm::IRBuilder<>& irb, llvm::Value* state,
+                                 bool inverse) {
+    uint32_t mask[16];
+    for (unsigned c = 0; c < 4; c++)
+        for (unsigned r = 0; r < 4; r++)
+            mask[4*c + r] = 4*((inverse ? c - r + 4 : c + r) % 4) + r;
+    return irb.CreateShuffleVector(state, state, mask);
+}
+
+/// Rotate the bytes of each column by the given number of rows.
+static llvm::Value* AesRotColumns(llvm::IRBuilder<>& irb, llvm::Value* state,
+                                  unsigned rows) {
+    uint32_t mask[16];
+    for (unsigned i = 0; i < 16; i++)
+        mask[i] = (i & ~3u) | ((i + rows) & 3);
+    return irb.CreateShuffleVector(state, state, mask);
+}
+
+/// Multiplication by x in GF(2^8) of all bytes.
+static llvm::Value* AesXtime(llvm::IRBuilder<>& irb, llvm::Value* state) {
+    llvm::Type* ty = state->getType();
+    llvm::Value* reduce = irb.CreateAShr(state, llvm::ConstantInt::get(ty, 7));
+    reduce = irb.CreateAnd(reduce, llvm::ConstantInt::get(ty, 0x1b));
+    llvm::Value* shifted = irb.CreateShl(state, llvm::ConstantInt::get(ty, 1));
+    return irb.CreateXor(shifted, reduce);
+}
+
+static llvm::Value* AesMixColumns(llvm::IRBuilder<>& irb, llvm::Value* state,
+                                  bool inverse) {
+    if (inverse) {
+        // InvMixColumns is MixColumns after adding 4*(a[r]^a[r+2]) to each
+        // byte, which saves the multiplications by 9, 11, 13 and 14.
+        llvm::Value* tmp = irb.CreateXor(state, AesRotColumns(irb, state, 2));
+        tmp = AesXtime(irb, AesXtime(irb, tmp));
+        state = irb.CreateXor(state, tmp);
+    }
+    // 2*a[r] ^ 3*a[r+1] ^ a[r+2] ^ a[r+3]
+    llvm::Value* rot1 = AesRotColumns(irb, state, 1);
+    llvm::Value* res = AesXtime(irb, irb.CreateXor(state, rot1));
+    res = irb.CreateXor(res, rot1);
+    res = irb.CreateXor(res, AesRotColumns(irb, state, 2));
+    return irb.CreateXor(res, AesRotColumns(irb, state, 3));
+}
+
+void Lifter::LiftAes(const LLInstr& inst) {
+    llvm::Value* state = OpLoad(inst.ops[inst.type == LL_INS_AESIMC ? 1 : 0],
+                                Facet::VI64, ALIGN_MAX);
+    llvm::Value* key = nullptr;
+    if (inst.type != LL_INS_AESIMC)
+        key = OpLoad(inst.ops[1], Facet::VI64, ALIGN_MAX);
+
+    if (HasTargetFeature("aes")) {
+        llvm::Intrinsic::ID id;
+        switch (inst.type) {
+        case LL_INS_AESENC: id = llvm::Intrinsic::x86_aesni_aesenc; break;
+        case LL_INS_AESENCLAST: id = llvm::Intrinsic::x86_aesni_aesenclast; break;
+        case LL_INS_AESDEC: id = llvm::Intrinsic::x86_aesni_aesdec; break;
+        case LL_INS_AESDECLAST: id = llvm::Intrinsic::x86_aesni_aesdeclast; break;
+        case LL_INS_AESIMC: id = llvm::Intrinsic::x86_aesni_aesimc; break;
+        default: assert(false && "invalid AES instruction"); return;
+        }
+        llvm::Module* module = irb.GetInsertBlock()->getModule();
+        auto intrinsic = llvm::Intrinsic::getDeclaration(module, id);
+        llvm::Value* res;
+        if (inst.type == LL_INS_AESIMC)
+            res = irb.CreateCall(intrinsic, {state});
+        else
+            res = irb.CreateCall(intrinsic, {state, key});
+        OpStoreVec(inst.ops[0], res);
+        return;
+    }
+
+    // Portable implementation of a single round. SubBytes and ShiftRows
+    // commute, so the order of these doesn't matter.
+    llvm::Type* bytes_ty = Facet{Facet::V16I8}.Type(irb.getContext());
+    llvm::Value* res = irb.CreateBitCast(state, bytes_ty);
+    switch (inst.type) {
+    case LL_INS_AESENC:
+    case LL_INS_AESENCLAST:
+        res = AesShiftRows(irb, AesSubBytes(irb, res, false), false);
+        if (inst.type == LL_INS_AESENC)
+            res = AesMixColumns(irb, res, false);
+        break;
+    case LL_INS_AESDEC:
+    case LL_INS_AESDECLAST:
+        res = AesShiftRows(irb, AesSubBytes(irb, res, true), true);
+        if (inst.type == LL_INS_AESDEC)
+            res = AesMixColumns(irb, res, true);
+        break;
+    case LL_INS_AESIMC:
+        res = AesMixColumns(irb, res, true);
+        break;
+    default:
+        assert(false && "invalid AES instruction");
+        return;
+    }
+    res = irb.CreateBitCast(res, state->getType());
+    if (inst.type != LL_INS_AESIMC)
+        res = irb.CreateXor(res, key);
+    OpStoreVec(inst.ops[0], res);
+}
+
+void Lifter::LiftAeskeygenassist(const LLInstr& inst) {
+    llvm::Value* src = OpLoad(inst.ops[1], Facet::VI64, ALIGN_MAX);
+    uint8_t rcon = inst.ops[2].val;
+
+    if (HasTargetFeature("aes")) {
+        llvm::Module* module = irb.GetInsertBlock()->getModule();
+        auto intrinsic = llvm::Intrinsic::getDeclaration(module,
+                            llvm::Intrinsic::x86_aesni_aeskeygenassist);
+        OpStoreVec(inst.ops[0], irb.CreateCall(intrinsic, {src, irb.getInt8(rcon)}));
+        return;
+    }
+
+    // Dwords 1 and 3 are substituted, the copies in dwords 1 and 3 of the
+    // result are additionally rotated right by 8 bits and xor-ed with rcon.
+    llvm::Type* bytes_ty = Facet{Facet::V16I8}.Type(irb.getContext());
+    llvm::Value* sub = AesSubBytes(irb, irb.CreateBitCast(src, bytes_ty), false);
+    uint32_t mask[16] = {4, 5, 6, 7, 5, 6, 7, 4, 12, 13, 14, 15, 13, 14, 15, 12};
+    llvm::Value* res = irb.CreateShuffleVector(sub, sub, mask);
+    res = irb.CreateBitCast(res, Facet{Facet::V4I32}.Type(irb.getContext()));
+    llvm::Value* rcon_vec = llvm::ConstantVector::get({irb.getInt32(0),
+            irb.getInt32(rcon), irb.getInt32(0), irb.getInt32(rcon)});
+    OpStoreVec(inst.ops[0], irb.CreateXor(res, rcon_vec));
+}
+
+void Lifter::LiftPclmulqdq(const LLInstr& inst) {
+    llvm::Value* src1 = OpLoad(inst.ops[0], Facet::VI64, ALIGN_MAX);
+    llvm::Value* src2 = OpLoad(inst.ops[1], Facet::VI64, ALIGN_MAX);
+    uint8_t imm = inst.ops[2].val;
+
+    if (HasTargetFeature("pclmul")) {
+        llvm::Module* module = irb.GetInsertBlock()->getModule();
+        auto intrinsic = llvm::Intrinsic::getDeclaration(module,
+                            llvm::Intrinsic::x86_pclmulqdq);
+        OpStoreVec(inst.ops[0], irb.CreateCall(intrinsic, {src1, src2, irb.getInt8(imm)}));
+        return;
+    }
+
+    // Shift-and-xor carry-less multiplication, without loop.
+    llvm::Value* op1 = irb.CreateExtractElement(src1, imm & 1 ? 1 : 0);
+    llvm::Value* op2 = irb.CreateExtractElement(src2, imm & 0x10 ? 1 : 0);
+    llvm::Value* ext_op1 = irb.CreateZExt(op1, irb.getInt128Ty());
+    llvm::Value* zero = llvm::Constant::getNullValue(irb.getInt128Ty());
+    llvm::Value* res = zero;
+    for (unsigned i = 0; i < 64; i++) {
+        llvm::Value* bit = irb.CreateAnd(op2, irb.getInt64(uint64_t{1} << i));
+        llvm::Value* set = irb.CreateICmpNE(bit, irb.getInt64(0));
+        llvm::Value* shifted = irb.CreateShl(ext_op1, i);
+        res = irb.CreateXor(res, irb.CreateSelect(set, shifted, zero));
+    }
+    OpStoreVec(inst.ops[0], irb.CreateBitCast(res, src1->getType()));
+}
+
 } // namespace
 
 /**
@@ -124,13 +124,38 @@ protected:
     // Operand handling implemented in lloperand.cc
 private:
     llvm::Value* OpAddrConst(uint64_t addr, llvm::PointerType* ptr_ty);
+    /// Load the FS or GS base from the CPU struct.
+    llvm::Value* SegmentBase(int seg);
 protected:
     llvm::Value* OpAddr(const LLInstrOp& op, llvm::Type* element_type);
-    llvm::Value* OpLoad(const LLInstrOp& op, Facet dataType, Alignment alignment = ALIGN_NONE);
-    void OpStoreGp(const LLInstrOp& op, llvm::Value* value, Alignment alignment = ALIGN_NONE);
-    void OpStoreVec(const LLInstrOp& op, llvm::Value* value, bool avx = false, Alignment alignment = ALIGN_IMP);
+    /// Memory accesses with nontemporal set get a hint that the data will not
+    /// be reused soon, for MOVNTI, MOVNTDQ and MOVNTDQA.
+    llvm::Value* OpLoad(const LLInstrOp& op, Facet dataType, Alignment alignment = ALIGN_NONE,
+                        bool nontemporal = false);
+    void OpStoreGp(const LLInstrOp& op, llvm::Value* value, Alignment alignment = ALIGN_NONE,
+                   bool nontemporal = false);
+    void OpStoreVec(const LLInstrOp& op, llvm::Value* value, bool avx = false, Alignment alignment = ALIGN_IMP,
+                    bool nontemporal = false);
     void StackPush(llvm::Value* value);
-    llvm::Value* StackPop(const LLReg sp_src_reg = LLReg(LL_RT_GP64, LL_RI_SP));
+    llvm::Value* StackPop(const LLReg sp_src_reg = LLReg(LL_RT_GP64, LL_RI_SP),
+                          llvm::Type* type = nullptr);
+    /// Whether the pointer facet of a 64-bit register operand was derived
+    /// from a pointer, i.e. it is not just an inttoptr of the integer value.
+    /// Facets which are not computed yet are not considered pointers.
+    bool HasPointerProvenance(const LLInstrOp& op);
+    /// Call the memory access hook, if configured, with the linear address.
+    /// All memory accesses of guest instructions must be reported.
+    void CallMemAccessHook(llvm::Value* addr, llvm::Type* type, bool store);
+    /// Apply the configured memory model to a general-purpose load or store.
+    /// Must be called directly after the access was created.
+    void OrderMemAccess(llvm::Instruction* access);
+    /// Emit a full fence under x86-TSO if the operand is in memory, for XCHG
+    /// and for CMPXCHG and XADD, which are assumed to be locked.
+    void FenceLocked(const LLInstrOp& op);
+    /// Whether the target-features attribute of the lifted function enables
+    /// the feature, e.g. "bmi2". Target intrinsics must only be emitted if
+    /// the backend can select them.
+    bool HasTargetFeature(llvm::StringRef feature);
 
     // llflags.cc
     void FlagCalcZ(llvm::Value* value) {
@@ -179,11 +204,16 @@ public:
 
     // llinstruction-gp.cc
     void Lift(const LLInstr&);
+    void LiftBlockHook(uint64_t block_addr);
 
 private:
     void LiftOverride(const LLInstr&, llvm::Function* override);
+    void CallIndirectBranchHook(const LLInstr&, llvm::Value* target);
+    llvm::Value* AddPointerFacet(const LLInstrOp& op1, const LLInstrOp& op2,
+                                 llvm::Value* op1_val, llvm::Value* op2_val);
 
     void LiftMovgp(const LLInstr&, llvm::Instruction::CastOps cast);
+    void LiftMovnti(const LLInstr&);
     void LiftAdd(const LLInstr&);
     void LiftAdc(const LLInstr&);
     void LiftXadd(const LLInstr&);
@@ -208,19 +238,24 @@ private:
     void LiftCext(const LLInstr& inst);
     void LiftCsep(const LLInstr& inst);
     void LiftBitscan(const LLInstr& inst, bool trailing);
+    void LiftBitcount(const LLInstr& inst, llvm::Intrinsic::ID id);
+    void LiftAndn(const LLInstr& inst);
+    void LiftBls(const LLInstr& inst);
+    void LiftShiftx(const LLInstr& inst, llvm::Instruction::BinaryOps op);
+    void LiftRorx(const LLInstr& inst);
+    void LiftMulx(const LLInstr& inst);
+    void LiftAdx(const LLInstr& inst, Facet flag);
+    void LiftPdepPext(const LLInstr& inst);
+    void LiftCrc32(const LLInstr& inst);
     void LiftBittest(const LLInstr& inst);
     void LiftMovbe(const LLInstr& inst);
     void LiftBswap(const LLInstr& inst);
 
-    void LiftPush(const LLInstr& inst) {
-        StackPush(OpLoad(inst.ops[0], Facet::I));
-    }
+    void LiftPush(const LLInstr& inst);
     void LiftPushf(const LLInstr& inst) {
         StackPush(FlagAsReg(inst.operand_size * 8));
     }
-    void LiftPop(const LLInstr& inst) {
-        OpStoreGp(inst.ops[0], StackPop());
-    }
+    void LiftPop(const LLInstr& inst);
     void LiftLeave(const LLInstr& inst) {
         llvm::Value* val = StackPop(LLReg(LL_RT_GP64, LL_RI_BP));
         OpStoreGp(LLInstrOp(LLReg(LL_RT_GP64, LL_RI_BP)), val);
@@ -258,7 +293,7 @@ private:
     void LiftSseBinOp(const LLInstr&, llvm::Instruction::BinaryOps op,
                       Facet type);
     void LiftSseMovScalar(const LLInstr&, Facet);
-    void LiftSseMovdq(const LLInstr&, Facet, Alignment);
+    void LiftSseMovdq(const LLInstr&, Facet, Alignment, bool nontemporal = false);
     void LiftSseMovlp(const LLInstr&);
     void LiftSseMovhps(const LLInstr&);
     void LiftSseMovhpd(const LLInstr&);
@@ -284,6 +319,9 @@ private:
     void LiftSsePcmp(const LLInstr&, llvm::CmpInst::Predicate, Facet);
     void LiftSsePminmax(const LLInstr&, llvm::CmpInst::Predicate, Facet);
     void LiftSseMovmsk(const LLInstr&, Facet op_type);
+    void LiftAes(const LLInstr&);
+    void LiftAeskeygenassist(const LLInstr&);
+    void LiftPclmulqdq(const LLInstr&);
 };
 
 } // namespace
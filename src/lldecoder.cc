@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <deque>
 #include <iostream>
 #include <unordered_map>
@@ -29,7 +30,9 @@
 #include <rellume/rellume.h>
 
 #include <rellume/instr.h>
+#include <decodecache.h>
 #include <function.h>
+#include <instrstream.h>
 
 namespace rellume {
 
@@ -56,24 +59,40 @@ namespace rellume {
                         (instr) == LL_INS_JMP || (instr) == LL_INS_CALL || \
                         (instr) == LL_INS_SYSCALL)
 
-int Function::Decode(uintptr_t addr, DecodeStop stop, MemReader memacc)
+// Default memory access functions loads instruction bytes from the same address
+// space.
+static size_t DefaultMemReader(uintptr_t mem_addr, uint8_t* buf, size_t buf_sz)
+{
+    memcpy(buf, reinterpret_cast<uint8_t*>(mem_addr), buf_sz);
+    return buf_sz;
+}
+
+int Function::Decode(uintptr_t addr, DecodeStop stop, MemReader memacc,
+                     DecodeCache* cache)
 {
     LLInstr inst;
-    uint8_t inst_buf[15];
-
-    if (memacc == nullptr) {
-        // Default memory access functions loads instruction bytes from the same
-        // address space.
-        memacc = [](uintptr_t mem_addr, uint8_t* buf, size_t buf_sz) {
-            memcpy(buf, reinterpret_cast<uint8_t*>(mem_addr), buf_sz);
-            return buf_sz;
-        };
-    }
+    // Instruction bytes are fetched in chunks, so that the memory reader isn't
+    // called for every single instruction. A chunk only crosses a page boundary
+    // if the next instruction might do so.
+    uint8_t fetch_buf[256];
+    uintptr_t fetch_addr = 0;
+    size_t fetch_sz = 0;
+
+    if (memacc == nullptr)
+        memacc = DefaultMemReader;
+
+    // Branches leaving a trace go to separate exit blocks.
+    side_exits = stop == DecodeStop::TRACE;
+    whole_function = stop == DecodeStop::ALL;
+
+    AddEntry(addr);
 
     std::deque<uintptr_t> addr_queue;
-    addr_queue.push_back(addr);
+    // The start address and additional entries of multi-entry functions.
+    for (uint64_t entry_addr : entry_addrs)
+        addr_queue.push_back(entry_addr);
 
-    std::vector<LLInstr> insts;
+    InstrStream insts;
     // List of (start_idx,end_idx) (non-inclusive end)
     std::vector<std::pair<size_t,size_t>> blocks;
 
@@ -83,26 +102,42 @@ int Function::Decode(uintptr_t addr, DecodeStop stop, MemReader memacc)
     while (!addr_queue.empty())
     {
         uintptr_t cur_addr = addr_queue.front();
+        uintptr_t block_addr = cur_addr;
         addr_queue.pop_front();
 
-        size_t cur_block_start = insts.size();
+        size_t cur_block_start = insts.Size();
 
         auto cur_addr_entry = addr_map.find(cur_addr);
         while (cur_addr_entry == addr_map.end())
         {
-            size_t inst_buf_sz = memacc(cur_addr, inst_buf, sizeof(inst_buf));
-            // Sanity check.
-            if (inst_buf_sz == 0 || inst_buf_sz > sizeof(inst_buf))
-                break;
+            if (cache == nullptr || !cache->Lookup(cur_addr, &inst)) {
+                if (cur_addr < fetch_addr || cur_addr - fetch_addr + 15 > fetch_sz) {
+                    size_t page_rest = 0x1000 - (cur_addr & 0xfff);
+                    size_t want = std::max<size_t>(15,
+                                    std::min(sizeof(fetch_buf), page_rest));
+                    fetch_addr = cur_addr;
+                    fetch_sz = memacc(cur_addr, fetch_buf, want);
+                    // Sanity check.
+                    if (fetch_sz == 0 || fetch_sz > want) {
+                        fetch_sz = 0;
+                        break;
+                    }
+                }
+
+                size_t fetch_off = cur_addr - fetch_addr;
+                inst = LLInstr::Decode(fetch_buf + fetch_off,
+                                       fetch_sz - fetch_off, cur_addr);
+                // If we reach an invalid instruction or an instruction we can't
+                // decode, stop.
+                if (inst.type == LL_INS_Invalid)
+                    break;
 
-            inst = LLInstr::Decode(inst_buf, inst_buf_sz, cur_addr);
-            // If we reach an invalid instruction or an instruction we can't
-            // decode, stop.
-            if (inst.type == LL_INS_Invalid)
-                break;
+                if (cache != nullptr)
+                    cache->Insert(inst);
+            }
 
-            addr_map[cur_addr] = std::make_pair(blocks.size(), insts.size());
-            insts.push_back(inst);
+            addr_map[cur_addr] = std::make_pair(blocks.size(), insts.Size());
+            insts.Push(inst);
 
             if (stop == DecodeStop::INSTR)
                 break;
@@ -111,6 +146,25 @@ int Function::Decode(uintptr_t addr, DecodeStop stop, MemReader memacc)
                 if (stop == DecodeStop::BASICBLOCK)
                     break;
 
+                if (stop == DecodeStop::TRACE) {
+                    // Continue with the more frequently executed successor,
+                    // the other one becomes a side exit of the trace.
+                    bool direct = inst.ops[0].type == LL_OP_IMM;
+                    uintptr_t fallthrough = cur_addr + inst.len;
+                    if (instrIsJcc(inst.type)) {
+                        uint64_t taken_count = 0, fallthrough_count = 0;
+                        if (direct)
+                            BranchProfile(block_addr, inst.ops[0].val,
+                                          fallthrough, &taken_count,
+                                          &fallthrough_count);
+                        bool taken = taken_count > fallthrough_count;
+                        addr_queue.push_back(taken ? inst.ops[0].val : fallthrough);
+                    } else if (inst.type == LL_INS_JMP && direct) {
+                        addr_queue.push_back(inst.ops[0].val);
+                    }
+                    break;
+                }
+
                 if (instrIsJcc(inst.type))
                     addr_queue.push_back(cur_addr + inst.len);
 
@@ -126,8 +180,8 @@ int Function::Decode(uintptr_t addr, DecodeStop stop, MemReader memacc)
             cur_addr_entry = addr_map.find(cur_addr);
         }
 
-        if (insts.size() != cur_block_start)
-            blocks.push_back(std::make_pair(cur_block_start, insts.size()));
+        if (insts.Size() != cur_block_start)
+            blocks.push_back(std::make_pair(cur_block_start, insts.Size()));
 
         if (cur_addr_entry != addr_map.end())
         {
@@ -139,18 +193,42 @@ int Function::Decode(uintptr_t addr, DecodeStop stop, MemReader memacc)
             blocks.push_back(std::make_pair(split_idx, end));
             blocks[cur_addr_entry->second.first].second = split_idx;
             for (size_t j = split_idx; j < end; j++)
-                addr_map[insts[j].addr] = std::make_pair(blocks.size()-1, j);
+                addr_map[insts.Addr(j)] = std::make_pair(blocks.size()-1, j);
         }
     }
 
     for (auto it = blocks.begin(); it != blocks.end(); it++)
     {
-        uint64_t block_addr = insts[it->first].addr;
+        uint64_t block_addr = insts.Addr(it->first);
         for (size_t j = it->first; j < it->second; j++)
-            AddInst(block_addr, insts[j]);
+            AddInst(block_addr, insts.Get(j));
     }
 
     return 0;
 }
 
+uint64_t Function::CodeChecksum(const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+                                MemReader memacc)
+{
+    if (memacc == nullptr)
+        memacc = DefaultMemReader;
+
+    // 64-bit FNV-1a over all bytes, ranges which can't be read completely are
+    // included with zero bytes.
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const auto& range : ranges) {
+        uint8_t buf[64];
+        for (uintptr_t cur = range.first; cur < range.second; cur += sizeof(buf)) {
+            size_t buf_sz = std::min<uint64_t>(sizeof(buf), range.second - cur);
+            size_t read_sz = memacc(cur, buf, buf_sz);
+            for (size_t i = 0; i < buf_sz; i++) {
+                hash ^= i < read_sz ? buf[i] : 0;
+                hash *= 0x100000001b3;
+            }
+        }
+    }
+
+    return hash;
+}
+
 } // namespace
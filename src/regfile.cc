@@ -80,6 +80,11 @@ public:
     void clear() {
         setAll([](Facet f) { return nullptr; });
     }
+    template<typename F>
+    void forEach(const F& func) {
+        for (unsigned i = 0; i < sizeof...(E); i++)
+            func(values[i]);
+    }
 };
 template<typename R, Facet::Value... E>
 const typename ValueMap<R, E...>::template LookupTable<Facet::Value, sizeof...(E), Facet::MAX> ValueMap<R, E...>::table({E...});
@@ -118,7 +123,18 @@ public:
     void InitAll(InitGenerator init_gen = nullptr);
 
     llvm::Value* GetReg(LLReg reg, Facet facet);
+    llvm::Value* PeekReg(LLReg reg, Facet facet) {
+        Entry* facet_entry = AccessRegFacet(reg, facet);
+        return facet_entry ? facet_entry->peek() : nullptr;
+    }
     void SetReg(LLReg reg, Facet facet, llvm::Value*, bool clear_facets);
+    void CopyReg(LLReg dst, LLReg src);
+    void SwapReg(LLReg reg1, LLReg reg2);
+    void SetRegGenerator(LLReg reg, Facet facet, Generator generator) {
+        Entry* facet_entry = AccessRegFacet(reg, facet);
+        assert(facet_entry && "attempt to store invalid facet");
+        *facet_entry = generator;
+    }
 
 private:
     class Entry {
@@ -141,6 +157,10 @@ private:
             return value;
         }
         llvm::Value* get() { return static_cast<llvm::Value*>(*this); }
+        /// The value, if it was already computed.
+        llvm::Value* peek() const { return value; }
+        /// Drop a pending generator, the facet is then derived on demand.
+        void DropGenerator() { generator = nullptr; }
     };
 
     llvm::BasicBlock* insert_block;
@@ -150,6 +170,15 @@ private:
     ValueMapFlags<Entry> flags;
 
     Entry* AccessRegFacet(LLReg reg, Facet facet);
+    /// Copy a facet map for a register move. Facets which are not computed
+    /// yet are derived from the native facet of the copy, which therefore
+    /// must be valid in the source.
+    template<typename M>
+    static void CopyMap(M& dst, M& src) {
+        M tmp = src;
+        tmp.forEach([](Entry& entry) { entry.DropGenerator(); });
+        dst = tmp;
+    }
 };
 
 void RegFile::impl::InitAll(InitGenerator fn) {
@@ -378,6 +407,36 @@ RegFile::impl::SetReg(LLReg reg, Facet facet, llvm::Value* value, bool clearOthe
     *facet_entry = value;
 }
 
+void RegFile::impl::CopyReg(LLReg dst, LLReg src) {
+    if (dst.IsGp() && src.IsGp()) {
+        GetReg(src, Facet::I64);
+        CopyMap(regs_gp[dst.ri], regs_gp[src.ri]);
+    } else if (dst.IsVec() && src.IsVec()) {
+        GetReg(src, Facet::IVEC);
+        CopyMap(regs_sse[dst.ri], regs_sse[src.ri]);
+    } else {
+        assert(false && "invalid register copy");
+    }
+}
+
+void RegFile::impl::SwapReg(LLReg reg1, LLReg reg2) {
+    if (reg1.IsGp() && reg2.IsGp()) {
+        GetReg(reg1, Facet::I64);
+        GetReg(reg2, Facet::I64);
+        ValueMapGp<Entry> tmp = regs_gp[reg1.ri];
+        CopyMap(regs_gp[reg1.ri], regs_gp[reg2.ri]);
+        CopyMap(regs_gp[reg2.ri], tmp);
+    } else if (reg1.IsVec() && reg2.IsVec()) {
+        GetReg(reg1, Facet::IVEC);
+        GetReg(reg2, Facet::IVEC);
+        ValueMapSse<Entry> tmp = regs_sse[reg1.ri];
+        CopyMap(regs_sse[reg1.ri], regs_sse[reg2.ri]);
+        CopyMap(regs_sse[reg2.ri], tmp);
+    } else {
+        assert(false && "invalid register swap");
+    }
+}
+
 RegFile::RegFile() : pimpl{std::make_unique<impl>()} {}
 RegFile::~RegFile() {}
 
@@ -393,9 +452,21 @@ void RegFile::InitAll(InitGenerator init_gen) {
 llvm::Value* RegFile::GetReg(LLReg reg, Facet facet) {
     return pimpl->GetReg(reg, facet);
 }
+llvm::Value* RegFile::PeekReg(LLReg reg, Facet facet) {
+    return pimpl->PeekReg(reg, facet);
+}
 void RegFile::SetReg(LLReg reg, Facet facet, llvm::Value* value, bool clear) {
     pimpl->SetReg(reg, facet, value, clear);
 }
+void RegFile::CopyReg(LLReg dst, LLReg src) {
+    pimpl->CopyReg(dst, src);
+}
+void RegFile::SwapReg(LLReg reg1, LLReg reg2) {
+    pimpl->SwapReg(reg1, reg2);
+}
+void RegFile::SetRegGenerator(LLReg reg, Facet facet, Generator generator) {
+    pimpl->SetRegGenerator(reg, facet, generator);
+}
 
 } // namespace
 
@@ -29,11 +29,69 @@
 
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Value.h>
+#include <bitset>
 #include <functional>
 
 
 namespace rellume {
 
+/// A set of architectural registers, used to describe which registers are live
+/// at function exits. Flags are tracked individually; the instruction pointer
+/// is always part of the set.
+class RegSet
+{
+public:
+    RegSet() = default;
+
+    static RegSet All() {
+        RegSet res;
+        res.gp.set();
+        res.sse.set();
+        res.flags.set();
+        return res;
+    }
+
+    /// Add a register. For LL_RT_EFLAGS, all flags are added.
+    void Add(LLReg reg) {
+        if (reg.rt == LL_RT_EFLAGS)
+            flags.set();
+        else
+            Add(reg, Facet::I64);
+    }
+    /// Add a single flag or register. The facet is ignored for non-flags.
+    void Add(LLReg reg, Facet facet) {
+        if (reg.IsGpHigh())
+            gp.set(reg.ri - 4);
+        else if (reg.IsGp() && reg.ri < gp.size())
+            gp.set(reg.ri);
+        else if (reg.IsVec() && reg.ri < sse.size())
+            sse.set(reg.ri);
+        else if (reg.rt == LL_RT_EFLAGS && FlagIdx(facet) < flags.size())
+            flags.set(FlagIdx(facet));
+    }
+
+    bool Contains(LLReg reg, Facet facet) const {
+        if (reg.rt == LL_RT_IP)
+            return true;
+        if (reg.IsGp())
+            return reg.ri < gp.size() && gp.test(reg.ri);
+        if (reg.IsVec())
+            return reg.ri < sse.size() && sse.test(reg.ri);
+        if (reg.rt == LL_RT_EFLAGS)
+            return FlagIdx(facet) < flags.size() && flags.test(FlagIdx(facet));
+        return false;
+    }
+
+private:
+    static size_t FlagIdx(Facet facet) {
+        return static_cast<size_t>(facet) - static_cast<size_t>(Facet::ZF);
+    }
+
+    std::bitset<LL_RI_GPMax> gp;
+    std::bitset<LL_RI_XMMMax> sse;
+    std::bitset<Facet::DF - Facet::ZF + 1> flags;
+};
+
 class RegFile
 {
 public:
@@ -54,7 +112,19 @@ public:
     void InitAll(InitGenerator init_gen = nullptr);
 
     llvm::Value* GetReg(LLReg reg, Facet facet);
+    /// Get the value of a facet only if it is already computed, without
+    /// running generators (e.g. creating PHI nodes) or deriving it from other
+    /// facets. Returns nullptr otherwise.
+    llvm::Value* PeekReg(LLReg reg, Facet facet);
     void SetReg(LLReg reg, Facet facet, llvm::Value*, bool clear_facets);
+    /// Copy all facets of a full register to another register of the same
+    /// kind (general purpose or vector), as for a move of the entire register.
+    void CopyReg(LLReg dst, LLReg src);
+    /// Exchange all facets of two full registers of the same kind.
+    void SwapReg(LLReg reg1, LLReg reg2);
+    /// Set a generator for a facet, which is called when the value is first
+    /// requested. Other facets are not modified.
+    void SetRegGenerator(LLReg reg, Facet facet, Generator generator);
 
 private:
     class impl;
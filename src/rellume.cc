@@ -25,6 +25,7 @@
 
 #include "callconv.h"
 #include "config.h"
+#include "decodecache.h"
 #include "function.h"
 #include "transforms.h"
 #include <llvm/IR/Module.h>
@@ -32,6 +33,8 @@
 #include <llvm-c/Core.h>
 #include <cstdbool>
 #include <cstdint>
+#include <utility>
+#include <vector>
 
 
 namespace {
@@ -41,6 +44,9 @@ static rellume::LLConfig* unwrap(LLConfig* fn) {
 static rellume::Function* unwrap(LLFunc* fn) {
     return reinterpret_cast<rellume::Function*>(fn);
 }
+static rellume::DecodeCache* unwrap(LLDecodeCache* cache) {
+    return reinterpret_cast<rellume::DecodeCache*>(cache);
+}
 }
 
 LLConfig* ll_config_new(void) {
@@ -52,6 +58,38 @@ void ll_config_free(LLConfig* cfg) {
 void ll_config_set_hhvm(LLConfig* cfg, bool hhvm) {
     unwrap(cfg)->callconv = hhvm ? rellume::CallConv::HHVM : rellume::CallConv::SPTR;
 }
+void ll_config_set_call_conv(LLConfig* cfg, LLCallConv cconv) {
+    unwrap(cfg)->callconv = static_cast<rellume::CallConv::Value>(cconv);
+}
+void ll_config_set_cpu_layout(LLConfig* cfg, LLCpuLayout layout) {
+    if (layout == RELLUME_CPU_LAYOUT_PACKED)
+        unwrap(cfg)->cpu_layout = rellume::CpuStructLayout::Packed();
+    else
+        unwrap(cfg)->cpu_layout = rellume::CpuStructLayout();
+}
+bool ll_config_set_cpu_reg_offset(LLConfig* cfg, const char* name, size_t offset) {
+    auto entry = rellume::CpuStructLayout::Lookup(name);
+    if (entry == rellume::CpuStructLayout::NUM_ENTRIES)
+        return false;
+    unwrap(cfg)->cpu_layout.SetOffset(entry, offset);
+    return true;
+}
+void ll_config_set_packed_flags(LLConfig* cfg, bool packed) {
+    unwrap(cfg)->cpu_layout.SetPackedFlags(packed);
+}
+size_t ll_config_cpu_struct_size(LLConfig* cfg) {
+    return unwrap(cfg)->cpu_layout.Size();
+}
+int64_t ll_config_cpu_reg_offset(LLConfig* cfg, const char* name) {
+    const auto& layout = unwrap(cfg)->cpu_layout;
+    auto entry = rellume::CpuStructLayout::Lookup(name);
+    if (entry == rellume::CpuStructLayout::NUM_ENTRIES)
+        return -1;
+    // The flag word only exists with packed flags.
+    if (entry == rellume::CpuStructLayout::EFLAGS && !layout.PackedFlags())
+        return -1;
+    return layout.Offset(entry);
+}
 void ll_config_enable_overflow_intrinsics(LLConfig* cfg, bool enable) {
     unwrap(cfg)->enableOverflowIntrinsics = enable;
 }
@@ -61,6 +99,22 @@ void ll_config_enable_fast_math(LLConfig* cfg, bool enable) {
 void ll_config_enable_verify_ir(LLConfig* cfg, bool enable) {
     unwrap(cfg)->verify_ir = enable;
 }
+void ll_config_enable_pointer_provenance(LLConfig* cfg, bool enable) {
+    unwrap(cfg)->use_gep_ptr_arithmetic = enable;
+    unwrap(cfg)->prefer_pointer_cmp = enable;
+}
+void ll_config_enable_stack_promotion(LLConfig* cfg, bool enable) {
+    unwrap(cfg)->promote_stack = enable;
+}
+void ll_config_enable_stack_tracking(LLConfig* cfg, bool enable) {
+    unwrap(cfg)->track_stack = enable;
+}
+void ll_config_enable_access_type_unification(LLConfig* cfg, bool enable) {
+    unwrap(cfg)->unify_access_types = enable;
+}
+void ll_config_enable_alignment_propagation(LLConfig* cfg, bool enable) {
+    unwrap(cfg)->propagate_alignment = enable;
+}
 void ll_config_set_global_base(LLConfig* cfg, uintptr_t base, LLVMValueRef value) {
     unwrap(cfg)->global_base_addr = base;
     unwrap(cfg)->global_base_value = llvm::unwrap(value);
@@ -74,15 +128,57 @@ void ll_config_set_call_ret_clobber_flags(LLConfig* cfg, bool enable) {
 void ll_config_set_use_native_segment_base(LLConfig* cfg, bool enable) {
     unwrap(cfg)->use_native_segment_base = enable;
 }
+void ll_config_set_memory_model(LLConfig* cfg, LLMemoryModel model) {
+    unwrap(cfg)->memory_model = static_cast<rellume::MemoryModel>(model);
+}
+void ll_config_set_target(LLConfig* cfg, const char* cpu, const char* features) {
+    unwrap(cfg)->target_cpu = cpu ? cpu : "";
+    unwrap(cfg)->target_features = features ? features : "";
+}
+void ll_config_set_hook_block(LLConfig* cfg, LLVMValueRef value) {
+    unwrap(cfg)->hook_block = llvm::unwrap<llvm::Function>(value);
+}
+void ll_config_set_hook_mem_access(LLConfig* cfg, LLVMValueRef value) {
+    unwrap(cfg)->hook_mem_access = llvm::unwrap<llvm::Function>(value);
+}
+void ll_config_set_hook_indirect_branch(LLConfig* cfg, LLVMValueRef value) {
+    unwrap(cfg)->hook_indirect_branch = llvm::unwrap<llvm::Function>(value);
+}
+void ll_config_set_profile_counters(LLConfig* cfg, LLVMValueRef value) {
+    unwrap(cfg)->profile_counters = llvm::unwrap(value);
+}
 
 
 LLFunc* ll_func_new(LLVMModuleRef mod, LLConfig* cfg) {
     return reinterpret_cast<LLFunc*>(new rellume::Function(llvm::unwrap(mod), unwrap(cfg)));
 }
 
+void ll_func_add_entry(LLFunc* fn, uint64_t addr) {
+    unwrap(fn)->AddEntry(addr);
+}
 void ll_func_add_inst(LLFunc* fn, uint64_t block_addr, LLInstr* instr) {
     unwrap(fn)->AddInst(block_addr, *instr);
 }
+void ll_func_set_profile(LLFunc* fn, uint64_t block_addr, uint64_t count) {
+    unwrap(fn)->SetProfile(block_addr, count);
+}
+void ll_func_set_edge_profile(LLFunc* fn, uint64_t from, uint64_t to,
+                              uint64_t count) {
+    unwrap(fn)->SetEdgeProfile(from, to, count);
+}
+static rellume::RegSet ll_reg_set(const LLReg* regs, size_t count) {
+    rellume::RegSet res;
+    for (size_t i = 0; i < count; i++)
+        res.Add(regs[i]);
+    return res;
+}
+void ll_func_set_live_out(LLFunc* fn, const LLReg* regs, size_t count) {
+    unwrap(fn)->SetLiveOut(ll_reg_set(regs, count));
+}
+void ll_func_set_exit_live_out(LLFunc* fn, uint64_t target, const LLReg* regs,
+                               size_t count) {
+    unwrap(fn)->SetLiveOut(target, ll_reg_set(regs, count));
+}
 LLVMValueRef ll_func_lift(LLFunc* fn) {
     return llvm::wrap(unwrap(fn)->Lift());
 }
@@ -90,6 +186,19 @@ void ll_func_dispose(LLFunc* fn) {
     delete unwrap(fn);
 }
 
+size_t ll_func_counter_count(LLFunc* fn) {
+    return unwrap(fn)->CounterCount();
+}
+void ll_func_set_counter_base(LLFunc* fn, size_t base) {
+    unwrap(fn)->SetCounterBase(base);
+}
+int64_t ll_func_block_counter(LLFunc* fn, uint64_t block_addr) {
+    return unwrap(fn)->BlockCounter(block_addr);
+}
+int64_t ll_func_edge_counter(LLFunc* fn, uint64_t from, uint64_t to) {
+    return unwrap(fn)->EdgeCounter(from, to);
+}
+
 int ll_func_decode(LLFunc* func, uintptr_t addr) {
     return unwrap(func)->Decode(addr, rellume::Function::DecodeStop::ALL);
 }
@@ -99,11 +208,52 @@ int ll_func_decode2(LLFunc* func, uintptr_t addr, RellumeMemAccessCb mem_acc,
 }
 int ll_func_decode3(LLFunc* func, uintptr_t addr, LLDecodeStop stop,
                     RellumeMemAccessCb mem_acc, void* user_arg) {
+    return ll_func_decode4(func, addr, stop, mem_acc, user_arg, nullptr);
+}
+int ll_func_decode4(LLFunc* func, uintptr_t addr, LLDecodeStop stop,
+                    RellumeMemAccessCb mem_acc, void* user_arg,
+                    LLDecodeCache* cache) {
+    auto decode_stop = static_cast<rellume::Function::DecodeStop>(stop);
+    if (mem_acc == nullptr)
+        return unwrap(func)->Decode(addr, decode_stop, nullptr, unwrap(cache));
+
     auto memacc_l = [=](uintptr_t maddr, uint8_t* buf, size_t buf_sz) {
         return mem_acc(maddr, buf, buf_sz, user_arg);
     };
-    auto decode_stop = static_cast<rellume::Function::DecodeStop>(stop);
-    return unwrap(func)->Decode(addr, decode_stop, memacc_l);
+    return unwrap(func)->Decode(addr, decode_stop, memacc_l, unwrap(cache));
+}
+
+size_t ll_func_code_ranges(LLFunc* fn, uint64_t* ranges, size_t max_ranges) {
+    const auto& code_ranges = unwrap(fn)->CodeRanges();
+    for (size_t i = 0; i < code_ranges.size() && i < max_ranges; i++) {
+        ranges[2*i] = code_ranges[i].first;
+        ranges[2*i+1] = code_ranges[i].second;
+    }
+    return code_ranges.size();
+}
+uint64_t ll_code_checksum(const uint64_t* ranges, size_t count,
+                          RellumeMemAccessCb mem_acc, void* user_arg) {
+    std::vector<std::pair<uint64_t, uint64_t>> range_vec;
+    for (size_t i = 0; i < count; i++)
+        range_vec.push_back(std::make_pair(ranges[2*i], ranges[2*i+1]));
+    if (mem_acc == nullptr)
+        return rellume::Function::CodeChecksum(range_vec);
+
+    auto memacc_l = [=](uintptr_t maddr, uint8_t* buf, size_t buf_sz) {
+        return mem_acc(maddr, buf, buf_sz, user_arg);
+    };
+    return rellume::Function::CodeChecksum(range_vec, memacc_l);
+}
+
+LLDecodeCache* ll_decode_cache_new(void) {
+    return reinterpret_cast<LLDecodeCache*>(new rellume::DecodeCache());
+}
+void ll_decode_cache_free(LLDecodeCache* cache) {
+    delete unwrap(cache);
+}
+void ll_decode_cache_invalidate(LLDecodeCache* cache, uintptr_t start,
+                                uintptr_t end) {
+    unwrap(cache)->Invalidate(start, end);
 }
 
 void ll_func_fast_opt(LLVMValueRef llvm_fn) {
@@ -115,3 +265,10 @@ LLVMValueRef ll_func_wrap_sysv(LLVMValueRef fn, LLVMTypeRef ty,
                                            llvm::unwrap<llvm::FunctionType>(ty),
                                            stack_sz));
 }
+LLVMValueRef ll_func_wrap_sysv2(LLVMValueRef fn, LLVMTypeRef ty,
+                                LLVMModuleRef mod, size_t stack_sz,
+                                LLConfig* cfg) {
+    return llvm::wrap(rellume::WrapSysVAbi(llvm::unwrap<llvm::Function>(fn),
+                                           llvm::unwrap<llvm::FunctionType>(ty),
+                                           stack_sz, unwrap(cfg)->cpu_layout));
+}
@@ -0,0 +1,367 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#include "stackpromotion.h"
+
+#include <llvm/ADT/APInt.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/Support/MathExtras.h>
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+
+namespace rellume {
+
+namespace {
+
+class StackFrameAnalysis {
+public:
+    StackFrameAnalysis(llvm::Function* fn)
+            : fn(fn), dl(fn->getParent()->getDataLayout()) {}
+
+    void Run(llvm::Value* entry_sp);
+
+    /// Whether the address of the frame might be visible outside of the
+    /// function or through memory. In this case, accesses to the frame might
+    /// happen through other pointers.
+    bool Escapes() const { return escapes; }
+    /// Whether the stack pointer might point into the frame on return.
+    bool ReturnsIntoFrame() const { return returns_into_frame; }
+    /// Size of the frame below the entry stack pointer, or -1 if an access
+    /// crosses the boundary of the frame.
+    int64_t FrameSize() const;
+
+    /// Replace the address of all accesses by a constant GEP from base, which
+    /// is the address at offset base_offset from the entry stack pointer.
+    /// Only accesses below the entry stack pointer are rewritten if
+    /// frame_only is set. Returns the rewritten accesses with their offset
+    /// from base.
+    std::vector<std::pair<llvm::Instruction*, int64_t>>
+    Rewrite(llvm::Value* base, int64_t base_offset, bool frame_only);
+
+private:
+    struct Access {
+        llvm::Instruction* inst;
+        int64_t offset;
+        int64_t size;
+    };
+
+    void Track(llvm::Value* value, int64_t offset);
+    bool VisitUse(llvm::Use& use, int64_t offset);
+    bool IsExitStore(llvm::StoreInst* store);
+
+    llvm::Function* fn;
+    const llvm::DataLayout& dl;
+
+    /// Offset of values derived from the stack pointer relative to entry_sp.
+    std::unordered_map<llvm::Value*, int64_t> offsets;
+    std::deque<llvm::Value*> worklist;
+    std::vector<llvm::PHINode*> phis;
+    /// PHI nodes with incoming values of different or unknown offsets.
+    std::unordered_set<llvm::PHINode*> unknown_phis;
+    std::vector<Access> accesses;
+    bool escapes = false;
+    bool returns_into_frame = false;
+};
+
+void StackFrameAnalysis::Track(llvm::Value* value, int64_t offset) {
+    if (offsets.count(value)) {
+        // Only PHI nodes can be reached multiple times, they are verified
+        // after all uses are visited.
+        return;
+    }
+    offsets[value] = offset;
+    worklist.push_back(value);
+}
+
+bool StackFrameAnalysis::IsExitStore(llvm::StoreInst* store) {
+    // Stores of register values at function exits go to the CPU struct, which
+    // is a function argument. No memory is accessed after the return.
+    llvm::Value* base = llvm::GetUnderlyingObject(store->getPointerOperand(), dl);
+    if (!llvm::isa<llvm::Argument>(base))
+        return false;
+    return llvm::isa<llvm::ReturnInst>(store->getParent()->getTerminator());
+}
+
+bool StackFrameAnalysis::VisitUse(llvm::Use& use, int64_t offset) {
+    auto user = llvm::dyn_cast<llvm::Instruction>(use.getUser());
+    if (!user)
+        return false;
+
+    switch (user->getOpcode()) {
+    case llvm::Instruction::Add:
+    case llvm::Instruction::Sub: {
+        // Only constant offsets can be tracked. The stack pointer must be the
+        // first operand of a subtraction.
+        auto other = llvm::dyn_cast<llvm::ConstantInt>(user->getOperand(1 - use.getOperandNo()));
+        if (!other || other->getBitWidth() > 64)
+            return false;
+        if (user->getOpcode() == llvm::Instruction::Sub) {
+            if (use.getOperandNo() != 0)
+                return false;
+            Track(user, offset - other->getSExtValue());
+        } else {
+            Track(user, offset + other->getSExtValue());
+        }
+        return true;
+    }
+    case llvm::Instruction::IntToPtr:
+        // Segment-relative addresses (FS/GS) point somewhere else.
+        if (user->getType()->getPointerAddressSpace() != 0)
+            return false;
+        Track(user, offset);
+        return true;
+    case llvm::Instruction::PtrToInt:
+    case llvm::Instruction::BitCast:
+        Track(user, offset);
+        return true;
+    case llvm::Instruction::GetElementPtr: {
+        auto gep = llvm::cast<llvm::GEPOperator>(user);
+        if (use.getOperandNo() != 0 || gep->getPointerAddressSpace() != 0)
+            return false;
+        llvm::APInt gep_off(dl.getPointerSizeInBits(0), 0);
+        if (!gep->accumulateConstantOffset(dl, gep_off))
+            return false;
+        Track(user, offset + gep_off.getSExtValue());
+        return true;
+    }
+    case llvm::Instruction::PHI: {
+        // Optimistically assume that all incoming values have the same offset,
+        // this is verified after all uses are visited.
+        auto phi = llvm::cast<llvm::PHINode>(user);
+        if (unknown_phis.count(phi))
+            return false;
+        phis.push_back(phi);
+        Track(user, offset);
+        return true;
+    }
+    case llvm::Instruction::ICmp:
+        // Comparisons don't leak the address.
+        return true;
+    case llvm::Instruction::Load:
+        accesses.push_back(Access{user, offset,
+            static_cast<int64_t>(dl.getTypeStoreSize(user->getType()))});
+        return true;
+    case llvm::Instruction::Store: {
+        auto store = llvm::cast<llvm::StoreInst>(user);
+        if (use.getOperandNo() == store->getPointerOperandIndex()) {
+            llvm::Type* ty = store->getValueOperand()->getType();
+            accesses.push_back(Access{user, offset,
+                static_cast<int64_t>(dl.getTypeStoreSize(ty))});
+            return true;
+        }
+        // Storing the stack pointer is only fine when the function returns.
+        if (!IsExitStore(store))
+            return false;
+        returns_into_frame |= offset < 0;
+        return true;
+    }
+    case llvm::Instruction::InsertValue:
+        // Return value of calling conventions which return the stack pointer
+        // in a register.
+        if (use.getOperandNo() != 1)
+            return false;
+        returns_into_frame |= offset < 0;
+        return true;
+    default:
+        return false;
+    }
+}
+
+void StackFrameAnalysis::Run(llvm::Value* entry_sp) {
+    // Repeat the analysis until all PHI nodes have a consistent offset, values
+    // derived from other PHI nodes are not tracked.
+    bool changed = true;
+    while (changed) {
+        offsets.clear();
+        phis.clear();
+        accesses.clear();
+        escapes = false;
+        returns_into_frame = false;
+
+        Track(entry_sp, 0);
+        while (!worklist.empty()) {
+            llvm::Value* value = worklist.front();
+            worklist.pop_front();
+            int64_t offset = offsets[value];
+            for (llvm::Use& use : value->uses())
+                if (!VisitUse(use, offset))
+                    escapes = true;
+        }
+
+        changed = false;
+        for (llvm::PHINode* phi : phis) {
+            int64_t offset = offsets[phi];
+            for (llvm::Value* incoming : phi->incoming_values()) {
+                auto it = offsets.find(incoming);
+                if (it == offsets.end() || it->second != offset) {
+                    unknown_phis.insert(phi);
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+int64_t StackFrameAnalysis::FrameSize() const {
+    int64_t frame_size = 0;
+    for (const auto& access : accesses) {
+        // Accesses to the caller's frame are kept, but accesses must not
+        // cross the boundary of the frame.
+        if (access.offset < 0 && access.offset + access.size > 0)
+            return -1;
+        if (access.offset < 0 && -access.offset > frame_size)
+            frame_size = -access.offset;
+    }
+    return frame_size;
+}
+
+std::vector<std::pair<llvm::Instruction*, int64_t>>
+StackFrameAnalysis::Rewrite(llvm::Value* base, int64_t base_offset,
+                            bool frame_only) {
+    std::vector<std::pair<llvm::Instruction*, int64_t>> rewritten;
+    llvm::IRBuilder<> irb(fn->getContext());
+    for (const auto& access : accesses) {
+        if (frame_only && access.offset + access.size > 0)
+            continue;
+
+        irb.SetInsertPoint(access.inst);
+        int64_t off = access.offset - base_offset;
+        llvm::Value* ptr = irb.CreateConstGEP1_64(base, off);
+        if (auto load = llvm::dyn_cast<llvm::LoadInst>(access.inst)) {
+            ptr = irb.CreatePointerCast(ptr, load->getPointerOperandType());
+            load->setOperand(load->getPointerOperandIndex(), ptr);
+        } else {
+            auto store = llvm::cast<llvm::StoreInst>(access.inst);
+            ptr = irb.CreatePointerCast(ptr, store->getPointerOperandType());
+            store->setOperand(store->getPointerOperandIndex(), ptr);
+        }
+        rewritten.push_back(std::make_pair(access.inst, off));
+    }
+    return rewritten;
+}
+
+} // end anonymous namespace
+
+bool PromoteStack(llvm::Function* fn, llvm::Value* entry_sp) {
+    StackFrameAnalysis analysis(fn);
+    analysis.Run(entry_sp);
+    if (analysis.Escapes() || analysis.ReturnsIntoFrame())
+        return false;
+    int64_t frame_size = analysis.FrameSize();
+    if (frame_size <= 0)
+        return false;
+
+    llvm::BasicBlock& entry_bb = fn->getEntryBlock();
+    llvm::IRBuilder<> irb(&entry_bb, entry_bb.getFirstInsertionPt());
+    llvm::Type* frame_ty = llvm::ArrayType::get(irb.getInt8Ty(), frame_size);
+    llvm::AllocaInst* frame = irb.CreateAlloca(frame_ty, int{0});
+    frame->setAlignment(16);
+    llvm::Value* frame_base = irb.CreatePointerCast(frame, irb.getInt8PtrTy());
+
+    for (const auto& item : analysis.Rewrite(frame_base, -frame_size, true)) {
+        // The alignment of the original stack pointer is unknown, so the
+        // alignment can only be derived from the offset in the alloca.
+        unsigned align = llvm::MinAlign(16, item.second);
+        if (auto load = llvm::dyn_cast<llvm::LoadInst>(item.first)) {
+            if (load->getAlignment() > align)
+                load->setAlignment(align);
+        } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(item.first)) {
+            if (store->getAlignment() > align)
+                store->setAlignment(align);
+        }
+    }
+
+    return true;
+}
+
+llvm::Value* RebaseStackAccesses(llvm::Function* fn, llvm::Value* entry_sp,
+                                 bool add_scopes) {
+    StackFrameAnalysis analysis(fn);
+    analysis.Run(entry_sp);
+
+    llvm::IRBuilder<> irb(fn->getContext());
+    if (auto inst = llvm::dyn_cast<llvm::Instruction>(entry_sp)) {
+        irb.SetInsertPoint(inst->getNextNode());
+    } else {
+        llvm::BasicBlock& entry_bb = fn->getEntryBlock();
+        irb.SetInsertPoint(&entry_bb, entry_bb.getFirstInsertionPt());
+    }
+    llvm::Value* base = irb.CreateIntToPtr(entry_sp, irb.getInt8PtrTy());
+
+    // Rewrite accesses to the caller's frame as well, such that spills and
+    // arguments on the stack share the same base.
+    auto rewritten = analysis.Rewrite(base, 0, false);
+    if (!add_scopes || analysis.Escapes() || analysis.FrameSize() < 0)
+        return base;
+
+    // The frame of the function is only accessed through the stack pointer.
+    // Memory above the entry stack pointer might be accessed through other
+    // pointers, so these accesses get no alias scope.
+    llvm::MDBuilder mdb(fn->getContext());
+    llvm::MDNode* domain = mdb.createAnonymousAliasScopeDomain("rellume.stack");
+    llvm::MDNode* frame_scope = mdb.createAnonymousAliasScope(domain, "frame");
+    llvm::MDNode* other_scope = mdb.createAnonymousAliasScope(domain, "other");
+    llvm::MDNode* frame_list = llvm::MDNode::get(fn->getContext(), frame_scope);
+    llvm::MDNode* other_list = llvm::MDNode::get(fn->getContext(), other_scope);
+
+    std::unordered_set<llvm::Instruction*> frame_accesses;
+    for (const auto& item : rewritten)
+        if (item.second < 0)
+            frame_accesses.insert(item.first);
+    std::unordered_set<llvm::Instruction*> stack_accesses;
+    for (const auto& item : rewritten)
+        stack_accesses.insert(item.first);
+
+    for (llvm::BasicBlock& bb : *fn) {
+        for (llvm::Instruction& inst : bb) {
+            if (!llvm::isa<llvm::LoadInst>(inst) && !llvm::isa<llvm::StoreInst>(inst))
+                continue;
+            if (frame_accesses.count(&inst)) {
+                inst.setMetadata(llvm::LLVMContext::MD_alias_scope, frame_list);
+                inst.setMetadata(llvm::LLVMContext::MD_noalias, other_list);
+            } else if (!stack_accesses.count(&inst)) {
+                inst.setMetadata(llvm::LLVMContext::MD_alias_scope, other_list);
+                inst.setMetadata(llvm::LLVMContext::MD_noalias, frame_list);
+            }
+        }
+    }
+
+    return base;
+}
+
+} // namespace
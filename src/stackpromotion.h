@@ -0,0 +1,59 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#ifndef LL_STACKPROMOTION_H
+#define LL_STACKPROMOTION_H
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Value.h>
+
+
+namespace rellume {
+
+/// Replace accesses to the stack frame of a lifted function with accesses to
+/// an alloca. entry_sp is the integer value of the stack pointer on function
+/// entry. All uses of the stack pointer must have a constant offset to
+/// entry_sp, the frame (memory below entry_sp) must not escape and the stack
+/// pointer must not point into the frame when the function returns, otherwise
+/// the function is not modified. Returns whether the stack was promoted.
+///
+/// The caller must ensure that the frame is dead at all exits, i.e. the
+/// function was lifted from its real entry and all exits are returns.
+/// Otherwise, data below the stack pointer (e.g. in the red zone) might be
+/// used by the code executed after the lifted function.
+bool PromoteStack(llvm::Function* fn, llvm::Value* entry_sp);
+
+/// Rewrite all memory accesses at a constant offset from entry_sp as constant
+/// GEPs from a single base pointer, also when the stack pointer is passed
+/// through PHI nodes. If the frame does not escape and add_scopes is set,
+/// accesses to the frame and accesses not relative to the stack pointer are
+/// put into disjoint alias scopes. This is only valid if no pointer into the
+/// frame exists on entry, i.e. the function is lifted from its real entry;
+/// otherwise, a register might point into the red zone. Returns the base
+/// pointer, which has the value of entry_sp.
+llvm::Value* RebaseStackAccesses(llvm::Function* fn, llvm::Value* entry_sp,
+                         bool add_scopes);
+
+} // namespace
+
+#endif
@@ -23,32 +23,45 @@
 
 #include "transforms.h"
 
+#include "callconv.h"
 #include "facet.h"
 #include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/ValueTracking.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Dominators.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/GlobalValue.h>
+#include <llvm/IR/InstrTypes.h>
+#include <llvm/IR/Instructions.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Support/MathExtras.h>
 #include <llvm/Transforms/InstCombine/InstCombine.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Utils/Cloning.h>
 #include <cassert>
 #include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
 
 
 namespace rellume {
 
 namespace {
 
-static llvm::Value* GepHelper(llvm::IRBuilder<>& irb, llvm::Value* base, llvm::ArrayRef<unsigned> idxs) {
-    llvm::SmallVector<llvm::Value*, 4> consts;
-    for (auto& idx : idxs)
-        consts.push_back(irb.getInt32(idx));
-    return irb.CreateGEP(base, consts);
+static llvm::Value* RegPtr(llvm::IRBuilder<>& irb, llvm::Value* sptr,
+                           const CpuStructLayout& layout,
+                           CpuStructLayout::Entry entry, llvm::Type* ty) {
+    llvm::Value* ptr = irb.CreateConstGEP1_64(sptr, layout.Offset(entry));
+    return irb.CreatePointerCast(ptr, ty->getPointerTo());
+}
+
+static CpuStructLayout::Entry GpEntry(unsigned idx) {
+    return static_cast<CpuStructLayout::Entry>(CpuStructLayout::RAX + idx);
 }
 
 }
@@ -69,25 +82,202 @@ void FastOpt(llvm::Function* llvm_fn) {
     pm.doFinalization();
 }
 
+void UnifyAccessTypes(llvm::Function* llvm_fn) {
+    const llvm::DataLayout& dl = llvm_fn->getParent()->getDataLayout();
+
+    // Group simple loads and stores by their location. Atomic accesses keep
+    // their type, as not all types are valid for atomic operations.
+    using Location = std::pair<llvm::Value*, int64_t>;
+    std::map<Location, std::vector<llvm::Instruction*>> locations;
+    for (llvm::BasicBlock& bb : *llvm_fn) {
+        for (llvm::Instruction& inst : bb) {
+            llvm::Value* ptr;
+            if (auto load = llvm::dyn_cast<llvm::LoadInst>(&inst)) {
+                if (!load->isSimple())
+                    continue;
+                ptr = load->getPointerOperand();
+            } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(&inst)) {
+                if (!store->isSimple())
+                    continue;
+                ptr = store->getPointerOperand();
+            } else {
+                continue;
+            }
+
+            int64_t offset = 0;
+            llvm::Value* base = llvm::GetPointerBaseWithConstantOffset(ptr, offset, dl);
+            locations[std::make_pair(base, offset)].push_back(&inst);
+        }
+    }
+
+    auto access_type = [](llvm::Instruction* inst) {
+        if (auto store = llvm::dyn_cast<llvm::StoreInst>(inst))
+            return store->getValueOperand()->getType();
+        return inst->getType();
+    };
+
+    for (auto& location : locations) {
+        std::vector<llvm::Instruction*>& accesses = location.second;
+
+        // Use the most frequent type, or the first type for ties. Differently
+        // sized accesses (e.g., a partial register store) are left alone.
+        std::map<llvm::Type*, unsigned> type_counts;
+        llvm::Type* common_ty = nullptr;
+        for (llvm::Instruction* inst : accesses) {
+            llvm::Type* ty = access_type(inst);
+            unsigned count = ++type_counts[ty];
+            if (common_ty == nullptr || count > type_counts[common_ty])
+                common_ty = ty;
+        }
+        if (type_counts.size() < 2)
+            continue;
+
+        bool compatible = true;
+        for (const auto& item : type_counts) {
+            llvm::Type* ty = item.first;
+            compatible &= dl.getTypeStoreSize(ty) == dl.getTypeStoreSize(common_ty);
+            compatible &= llvm::CastInst::isBitOrNoopPointerCastable(ty, common_ty, dl);
+            compatible &= llvm::CastInst::isBitOrNoopPointerCastable(common_ty, ty, dl);
+        }
+        if (!compatible)
+            continue;
+
+        for (llvm::Instruction* inst : accesses) {
+            llvm::Type* ty = access_type(inst);
+            if (ty == common_ty)
+                continue;
+
+            llvm::IRBuilder<> irb(inst);
+            llvm::Value* ptr = llvm::getLoadStorePointerOperand(inst);
+            unsigned addrspace = ptr->getType()->getPointerAddressSpace();
+            ptr = irb.CreatePointerCast(ptr, common_ty->getPointerTo(addrspace));
+
+            llvm::Instruction* new_inst;
+            if (auto load = llvm::dyn_cast<llvm::LoadInst>(inst)) {
+                llvm::LoadInst* new_load = irb.CreateLoad(ptr);
+                new_load->setAlignment(load->getAlignment());
+                new_inst = new_load;
+                load->replaceAllUsesWith(irb.CreateBitOrPointerCast(new_load, ty));
+            } else {
+                auto store = llvm::cast<llvm::StoreInst>(inst);
+                llvm::Value* value = store->getValueOperand();
+                value = irb.CreateBitOrPointerCast(value, common_ty);
+                llvm::StoreInst* new_store = irb.CreateStore(value, ptr);
+                new_store->setAlignment(store->getAlignment());
+                new_inst = new_store;
+            }
+            new_inst->copyMetadata(*inst);
+            inst->eraseFromParent();
+        }
+    }
+}
+
+void PropagateAlignment(llvm::Function* llvm_fn, llvm::Value* stack_base) {
+    const llvm::DataLayout& dl = llvm_fn->getParent()->getDataLayout();
+    llvm::DominatorTree dom_tree(*llvm_fn);
+
+    struct Access {
+        llvm::Instruction* inst;
+        int64_t offset;
+        unsigned align;
+    };
+
+    // Group accesses by their base pointer. Facts are accesses with a known
+    // alignment, a fact without instruction holds in the entire function.
+    std::map<llvm::Value*, std::vector<Access>> bases;
+    std::map<llvm::Value*, std::vector<Access>> facts;
+    if (stack_base != nullptr)
+        facts[stack_base].push_back(Access{nullptr, 8, 16});
+    for (llvm::BasicBlock& bb : *llvm_fn) {
+        for (llvm::Instruction& inst : bb) {
+            unsigned align;
+            llvm::Type* ty;
+            if (auto load = llvm::dyn_cast<llvm::LoadInst>(&inst)) {
+                align = load->getAlignment();
+                ty = load->getType();
+            } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(&inst)) {
+                align = store->getAlignment();
+                ty = store->getValueOperand()->getType();
+            } else {
+                continue;
+            }
+            // Only full-width SSE operands which must be aligned (e.g. MOVAPS)
+            // fault if misaligned; the lifter gives them an alignment equal to
+            // their size. Other alignments, in particular the ABI alignment
+            // for alignment zero, are assumptions and prove nothing.
+            unsigned size = dl.getTypeStoreSize(ty);
+            bool checked = size >= 16 && align == size;
+            if (align == 0)
+                align = dl.getABITypeAlignment(ty);
+
+            int64_t offset = 0;
+            llvm::Value* ptr = llvm::getLoadStorePointerOperand(&inst);
+            llvm::Value* base = llvm::GetPointerBaseWithConstantOffset(ptr, offset, dl);
+            bases[base].push_back(Access{&inst, offset, align});
+            if (checked)
+                facts[base].push_back(Access{&inst, offset, align});
+        }
+    }
+
+    for (auto& item : bases) {
+        std::vector<Access>& accesses = item.second;
+        auto facts_it = facts.find(item.first);
+        if (facts_it == facts.end())
+            continue;
+
+        // An access with alignment A at base+off1 proves that base+off2 is
+        // aligned to the largest power of two dividing A and off2-off1 in all
+        // code dominated by the access. Only the original alignments are used
+        // as facts, so the order of the accesses doesn't matter.
+        for (Access& access : accesses) {
+            unsigned new_align = access.align;
+            for (const Access& fact : facts_it->second) {
+                if (fact.align <= new_align || fact.inst == access.inst)
+                    continue;
+                if (fact.inst && !dom_tree.dominates(fact.inst, access.inst))
+                    continue;
+                uint64_t diff = static_cast<uint64_t>(access.offset - fact.offset);
+                unsigned align = llvm::MinAlign(fact.align, diff);
+                if (align > new_align)
+                    new_align = align;
+            }
+
+            if (new_align == access.align)
+                continue;
+            if (auto load = llvm::dyn_cast<llvm::LoadInst>(access.inst))
+                load->setAlignment(new_align);
+            else
+                llvm::cast<llvm::StoreInst>(access.inst)->setAlignment(new_align);
+        }
+    }
+}
+
 llvm::Function* WrapSysVAbi(llvm::Function* orig_fn, llvm::FunctionType* fn_ty,
-                            std::size_t stack_size) {
+                            std::size_t stack_size,
+                            const CpuStructLayout& layout) {
     llvm::LLVMContext& ctx = orig_fn->getContext();
     llvm::Function* new_fn = llvm::Function::Create(fn_ty, llvm::GlobalValue::ExternalLinkage, "glob", orig_fn->getParent());
+    // The lifted function is inlined, so the wrapper must allow the same
+    // instructions.
+    for (const char* attr : {"target-cpu", "target-features"})
+        if (orig_fn->hasFnAttribute(attr))
+            new_fn->addFnAttr(orig_fn->getFnAttribute(attr));
     llvm::BasicBlock* llvm_bb = llvm::BasicBlock::Create(ctx, "", new_fn);
 
     llvm::IRBuilder<> irb(llvm_bb);
 
-    llvm::SmallVector<llvm::Type*, 4> cpu_types;
-    cpu_types.push_back(irb.getInt64Ty()); // instruction pointer
-    cpu_types.push_back(llvm::ArrayType::get(irb.getInt64Ty(), 16));
-    cpu_types.push_back(llvm::ArrayType::get(irb.getInt1Ty(), 7));
-    cpu_types.push_back(llvm::ArrayType::get(irb.getIntNTy(LL_VECTOR_REGISTER_SIZE), 16));
-    llvm::Type* cpu_type = llvm::StructType::get(irb.getContext(), cpu_types);
-
-    llvm::Value* alloca = irb.CreateAlloca(cpu_type, int{0});
+    llvm::Type* i64 = irb.getInt64Ty();
+    llvm::Type* vec_type = irb.getIntNTy(LL_VECTOR_REGISTER_SIZE);
+    llvm::Type* cpu_type = llvm::ArrayType::get(irb.getInt8Ty(), layout.Size());
+    llvm::AllocaInst* cpu_alloca = irb.CreateAlloca(cpu_type, int{0});
+    cpu_alloca->setAlignment(64);
+    llvm::Value* alloca = irb.CreatePointerCast(cpu_alloca, irb.getInt8PtrTy());
 
     // Set direction flag to zero
-    irb.CreateStore(irb.getFalse(), rellume::GepHelper(irb, alloca, {0, 2, 6}));
+    if (layout.PackedFlags())
+        irb.CreateStore(irb.getInt64(2), RegPtr(irb, alloca, layout, CpuStructLayout::EFLAGS, i64));
+    else
+        irb.CreateStore(irb.getFalse(), RegPtr(irb, alloca, layout, CpuStructLayout::DF, irb.getInt1Ty()));
 
     unsigned gp_regs[6] = { 7, 6, 2, 1, 8, 9 };
     unsigned gpRegOffset = 0;
@@ -98,22 +288,23 @@ llvm::Function* WrapSysVAbi(llvm::Function* orig_fn, llvm::FunctionType* fn_ty,
 
         if (type_kind == llvm::Type::TypeID::IntegerTyID)
         {
-            irb.CreateStore(arg, rellume::GepHelper(irb, alloca, {0, 1, gp_regs[gpRegOffset]}));
+            llvm::Value* intval = irb.CreateZExtOrTrunc(arg, i64);
+            irb.CreateStore(intval, RegPtr(irb, alloca, layout, GpEntry(gp_regs[gpRegOffset]), i64));
             gpRegOffset++;
         }
         else if (type_kind == llvm::Type::TypeID::PointerTyID)
         {
-            llvm::Value* intval = irb.CreatePtrToInt(arg, irb.getInt64Ty());
-            irb.CreateStore(intval, rellume::GepHelper(irb, alloca, {0, 1, gp_regs[gpRegOffset]}));
+            llvm::Value* intval = irb.CreatePtrToInt(arg, i64);
+            irb.CreateStore(intval, RegPtr(irb, alloca, layout, GpEntry(gp_regs[gpRegOffset]), i64));
             gpRegOffset++;
         }
         else if (type_kind == llvm::Type::TypeID::FloatTyID || type_kind == llvm::Type::TypeID::DoubleTyID)
         {
             llvm::Type* int_type = irb.getIntNTy(arg->getType()->getPrimitiveSizeInBits());
-            llvm::Type* vec_type = irb.getIntNTy(LL_VECTOR_REGISTER_SIZE);
             llvm::Value* intval = irb.CreateBitCast(arg, int_type);
             llvm::Value* ext = irb.CreateZExt(intval, vec_type);
-            irb.CreateStore(ext, rellume::GepHelper(irb, alloca, {0, 3, fpRegOffset}));
+            auto entry = static_cast<CpuStructLayout::Entry>(CpuStructLayout::XMM0 + fpRegOffset);
+            irb.CreateStore(ext, RegPtr(irb, alloca, layout, entry, vec_type));
             fpRegOffset++;
         }
         else
@@ -127,10 +318,9 @@ llvm::Function* WrapSysVAbi(llvm::Function* orig_fn, llvm::FunctionType* fn_ty,
     stack->setAlignment(16);
     llvm::Value* sp_ptr = irb.CreateGEP(stack, stack_sz_val);
     llvm::Value* sp = irb.CreatePtrToInt(sp_ptr, irb.getInt64Ty());
-    irb.CreateStore(sp, rellume::GepHelper(irb, alloca, {0, 1, 4}));
+    irb.CreateStore(sp, RegPtr(irb, alloca, layout, CpuStructLayout::RSP, i64));
 
-    llvm::Value* call_arg = irb.CreatePointerCast(alloca, irb.getInt8PtrTy());
-    llvm::CallInst* call = irb.CreateCall(orig_fn, {call_arg});
+    llvm::CallInst* call = irb.CreateCall(orig_fn, {alloca});
 
     llvm::Type* ret_type = new_fn->getReturnType();
     switch (ret_type->getTypeID())
@@ -141,18 +331,18 @@ llvm::Function* WrapSysVAbi(llvm::Function* orig_fn, llvm::FunctionType* fn_ty,
             irb.CreateRetVoid();
             break;
         case llvm::Type::TypeID::IntegerTyID:
-            ret = irb.CreateLoad(rellume::GepHelper(irb, alloca, {0, 1, 0}));
+            ret = irb.CreateLoad(RegPtr(irb, alloca, layout, CpuStructLayout::RAX, i64));
             ret = irb.CreateTruncOrBitCast(ret, ret_type);
             irb.CreateRet(ret);
             break;
         case llvm::Type::TypeID::PointerTyID:
-            ret = irb.CreateLoad(rellume::GepHelper(irb, alloca, {0, 1, 0}));
+            ret = irb.CreateLoad(RegPtr(irb, alloca, layout, CpuStructLayout::RAX, i64));
             ret = irb.CreateIntToPtr(ret, ret_type);
             irb.CreateRet(ret);
             break;
         case llvm::Type::TypeID::FloatTyID:
         case llvm::Type::TypeID::DoubleTyID:
-            ret = irb.CreateLoad(rellume::GepHelper(irb, alloca, {0, 3, 0}));
+            ret = irb.CreateLoad(RegPtr(irb, alloca, layout, CpuStructLayout::XMM0, vec_type));
             ret = irb.CreateTrunc(ret, irb.getIntNTy(ret_type->getPrimitiveSizeInBits()));
             ret = irb.CreateBitCast(ret, ret_type);
             irb.CreateRet(ret);
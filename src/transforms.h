@@ -24,6 +24,7 @@
 #ifndef LL_TRANSFORMS_H
 #define LL_TRANSFORMS_H
 
+#include "callconv.h"
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Type.h>
 #include <cstddef>
@@ -32,8 +33,24 @@
 namespace rellume {
 
 void FastOpt(llvm::Function* llvm_fn);
+/// Access each memory location, identified by a base pointer and a constant
+/// offset, with a single type. Loads and stores of the same size with a
+/// different type are rewritten to the most common type plus a cast of the
+/// value.
+void UnifyAccessTypes(llvm::Function* llvm_fn);
+/// Increase the alignment of loads and stores using the alignment of other
+/// accesses at a constant offset from the same base pointer which dominate
+/// them. Only SSE accesses which fault if misaligned prove an alignment. If
+/// stack_base is given, it is the stack pointer at the entry of a function
+/// called according to the System V ABI, i.e. stack_base+8 is 16-byte aligned.
+void PropagateAlignment(llvm::Function* llvm_fn,
+                        llvm::Value* stack_base = nullptr);
+/// Wrap a function lifted with the SPTR calling convention into a function
+/// following the System V ABI, using the CPU struct layout of the config used
+/// for lifting.
 llvm::Function* WrapSysVAbi(llvm::Function* orig_fn, llvm::FunctionType* fn_ty,
-                            std::size_t stack_size);
+                            std::size_t stack_size,
+                            const CpuStructLayout& layout = CpuStructLayout());
 
 }
 
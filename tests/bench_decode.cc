@@ -0,0 +1,106 @@
+
+#include <rellume/rellume.h>
+
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+
+// A typical mix of compiler-generated instructions without branches.
+static const uint8_t code_pattern[] = {
+    0x55,                                     // push rbp
+    0x48, 0x89, 0xe5,                         // mov rbp, rsp
+    0x48, 0x83, 0xec, 0x20,                   // sub rsp, 0x20
+    0x8b, 0x45, 0xfc,                         // mov eax, [rbp-4]
+    0x48, 0x8d, 0x04, 0xc5, 0x10, 0, 0, 0,    // lea rax, [rax*8+0x10]
+    0x48, 0x01, 0xd8,                         // add rax, rbx
+    0x48, 0x39, 0xc8,                         // cmp rax, rcx
+    0x0f, 0x28, 0xc1,                         // movaps xmm0, xmm1
+    0x66, 0x0f, 0xef, 0xc9,                   // pxor xmm1, xmm1
+    0x85, 0xc0,                               // test eax, eax
+    0xc9,                                     // leave
+};
+static const size_t code_pattern_instrs = 11;
+
+struct CodeReader {
+    const std::vector<uint8_t>* code;
+    size_t max_read;
+    size_t calls;
+};
+
+// Memory reader for the function decoder; the code is placed at address zero.
+// Reads are limited to max_read bytes.
+static size_t read_code(size_t addr, uint8_t* buf, size_t buf_sz, void* arg) {
+    CodeReader* reader = static_cast<CodeReader*>(arg);
+    reader->calls++;
+    if (addr >= reader->code->size())
+        return 0;
+    size_t read_sz = std::min(buf_sz, reader->code->size() - addr);
+    read_sz = std::min(read_sz, reader->max_read);
+    memcpy(buf, reader->code->data() + addr, read_sz);
+    return read_sz;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+// Decode the code as a single function, returns the time or a negative value
+// on error.
+static double bench_func_decode(CodeReader* reader, unsigned rounds) {
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < rounds; i++) {
+        llvm::LLVMContext ctx;
+        auto mod = std::make_unique<llvm::Module>("bench_decode", ctx);
+        LLConfig* rlcfg = ll_config_new();
+        LLFunc* rlfn = ll_func_new(llvm::wrap(mod.get()), rlcfg);
+        int err = ll_func_decode3(rlfn, 0, RELLUME_DECODE_ALL, read_code, reader);
+        ll_func_dispose(rlfn);
+        ll_config_free(rlcfg);
+        if (err)
+            return -1;
+    }
+    return seconds_since(start);
+}
+
+int main(int argc, char** argv) {
+    size_t repetitions = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1000;
+    unsigned rounds = 20;
+
+    std::vector<uint8_t> code;
+    for (size_t i = 0; i < repetitions; i++)
+        code.insert(code.end(), code_pattern, code_pattern + sizeof(code_pattern));
+    code.push_back(0xc3); // ret
+    size_t count = rounds * (repetitions * code_pattern_instrs + 1);
+
+    // A reader which returns at most 15 bytes forces one call per instruction,
+    // like fetching each instruction separately.
+    CodeReader single{&code, 15, 0};
+    double time_single = bench_func_decode(&single, rounds);
+    // Unrestricted reads allow the decoder to fetch larger chunks at once.
+    CodeReader chunked{&code, SIZE_MAX, 0};
+    double time_chunked = bench_func_decode(&chunked, rounds);
+    if (time_single < 0 || time_chunked < 0) {
+        fprintf(stderr, "error during decoding\n");
+        return 1;
+    }
+
+    printf("per-instr fetch: %zu instrs in %.3f s, %.2f Minstrs/s, %.3f reads/instr\n",
+           count, time_single, count / time_single / 1e6,
+           static_cast<double>(single.calls) / count);
+    printf("chunked fetch:   %zu instrs in %.3f s, %.2f Minstrs/s, %.3f reads/instr\n",
+           count, time_chunked, count / time_chunked / 1e6,
+           static_cast<double>(chunked.calls) / count);
+
+    return 0;
+}
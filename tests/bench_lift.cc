@@ -0,0 +1,183 @@
+
+#include <rellume/rellume.h>
+
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/TargetSelect.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+// Multiply-accumulate of two float arrays with the accumulator spilled to the
+// stack, which is also accessed as integer and double.
+//   void kernel(float* a, float* b, float* out, size_t n)
+static const uint8_t kernel_code[] = {
+    0x48, 0x83, 0xec, 0x18,                   // sub rsp, 0x18
+    0x0f, 0x57, 0xc0,                         // xorps xmm0, xmm0
+    0x0f, 0x11, 0x04, 0x24,                   // movups [rsp], xmm0
+    0x0f, 0x10, 0x0f,                         // 1: movups xmm1, [rdi]
+    0x0f, 0x10, 0x16,                         // movups xmm2, [rsi]
+    0x0f, 0x59, 0xca,                         // mulps xmm1, xmm2
+    0x0f, 0x10, 0x04, 0x24,                   // movups xmm0, [rsp]
+    0x0f, 0x58, 0xc1,                         // addps xmm0, xmm1
+    0x0f, 0x11, 0x04, 0x24,                   // movups [rsp], xmm0
+    0x48, 0x8b, 0x44, 0x24, 0x08,             // mov rax, [rsp+8]
+    0x48, 0x89, 0x44, 0x24, 0x10,             // mov [rsp+0x10], rax
+    0xf2, 0x0f, 0x10, 0x5c, 0x24, 0x10,       // movsd xmm3, [rsp+0x10]
+    0x48, 0x83, 0xc7, 0x10,                   // add rdi, 0x10
+    0x48, 0x83, 0xc6, 0x10,                   // add rsi, 0x10
+    0x48, 0x83, 0xe9, 0x04,                   // sub rcx, 4
+    0x75, 0xce,                               // jnz 1b
+    0x0f, 0x10, 0x04, 0x24,                   // movups xmm0, [rsp]
+    0x0f, 0x11, 0x02,                         // movups [rdx], xmm0
+    0xf2, 0x0f, 0x11, 0x5a, 0x10,             // movsd [rdx+0x10], xmm3
+    0x48, 0x83, 0xc4, 0x18,                   // add rsp, 0x18
+    0xc3,                                     // ret
+};
+
+using KernelFn = void(*)(float*, float*, float*, size_t);
+
+struct BenchConfig {
+    const char* name;
+    bool unify_access_types;
+    bool track_stack;
+};
+
+struct BenchResult {
+    double time_lift = 0;
+    double time_jit = 0;
+    double time_run = 0;
+    size_t casts = 0;
+    float out[6] = {};
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+static size_t count_casts(llvm::Function* fn) {
+    size_t count = 0;
+    for (llvm::BasicBlock& bb : *fn)
+        for (llvm::Instruction& inst : bb)
+            count += llvm::isa<llvm::CastInst>(inst);
+    return count;
+}
+
+static bool run_config(const BenchConfig& bench_cfg, unsigned rounds,
+                       std::vector<float>& a, std::vector<float>& b,
+                       BenchResult& res) {
+    for (unsigned i = 0; i < rounds; i++) {
+        llvm::LLVMContext ctx;
+        auto mod = std::make_unique<llvm::Module>("bench_lift", ctx);
+
+        auto start = std::chrono::steady_clock::now();
+        LLConfig* rlcfg = ll_config_new();
+        ll_config_enable_access_type_unification(rlcfg, bench_cfg.unify_access_types);
+        ll_config_enable_stack_tracking(rlcfg, bench_cfg.track_stack);
+        LLFunc* rlfn = ll_func_new(llvm::wrap(mod.get()), rlcfg);
+        ll_func_decode(rlfn, reinterpret_cast<uintptr_t>(kernel_code));
+        llvm::Function* fn = llvm::unwrap<llvm::Function>(ll_func_lift(rlfn));
+        ll_func_dispose(rlfn);
+        if (fn == nullptr) {
+            ll_config_free(rlcfg);
+            fprintf(stderr, "%s: error during lifting\n", bench_cfg.name);
+            return false;
+        }
+        ll_func_fast_opt(llvm::wrap(fn));
+        res.time_lift += seconds_since(start);
+        res.casts = count_casts(fn);
+
+        start = std::chrono::steady_clock::now();
+        llvm::Type* i8p = llvm::Type::getInt8PtrTy(ctx);
+        llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+        llvm::FunctionType* fn_ty = llvm::FunctionType::get(
+                llvm::Type::getVoidTy(ctx), {i8p, i8p, i8p, i64}, false);
+        LLVMValueRef wrapped = ll_func_wrap_sysv2(llvm::wrap(fn),
+                                                  llvm::wrap(fn_ty),
+                                                  llvm::wrap(mod.get()), 4096,
+                                                  rlcfg);
+        ll_config_free(rlcfg);
+        if (wrapped == nullptr) {
+            fprintf(stderr, "%s: error during wrapping\n", bench_cfg.name);
+            return false;
+        }
+        std::string name = llvm::unwrap<llvm::Function>(wrapped)->getName().str();
+
+        std::string error;
+        llvm::EngineBuilder builder(std::move(mod));
+        builder.setEngineKind(llvm::EngineKind::JIT);
+        builder.setErrorStr(&error);
+        builder.setOptLevel(llvm::CodeGenOpt::Default);
+        std::unique_ptr<llvm::ExecutionEngine> engine(builder.create());
+        if (!engine) {
+            fprintf(stderr, "error creating engine: %s\n", error.c_str());
+            return false;
+        }
+        auto kernel = reinterpret_cast<KernelFn>(engine->getFunctionAddress(name));
+        res.time_jit += seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        kernel(a.data(), b.data(), res.out, a.size());
+        res.time_run += seconds_since(start);
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+    size_t elements = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1 << 20;
+    unsigned rounds = 20;
+    elements &= ~size_t{3};
+    if (elements == 0)
+        elements = 4;
+
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    std::vector<float> a(elements);
+    std::vector<float> b(elements);
+    for (size_t i = 0; i < elements; i++) {
+        a[i] = static_cast<float>(i % 7) * 0.5f;
+        b[i] = static_cast<float>(i % 5) * 0.25f;
+    }
+
+    static const BenchConfig configs[] = {
+        {"default", false, false},
+        {"unified", true, false},
+        {"unified+stack", true, true},
+    };
+
+    BenchResult results[sizeof(configs) / sizeof(configs[0])];
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        if (!run_config(configs[i], rounds, a, b, results[i]))
+            return 1;
+
+        for (size_t j = 0; j < 6; j++) {
+            if (results[i].out[j] != results[0].out[j] &&
+                    !(std::isnan(results[i].out[j]) && std::isnan(results[0].out[j]))) {
+                fprintf(stderr, "%s: result mismatch\n", configs[i].name);
+                return 1;
+            }
+        }
+
+        printf("%-14s lift %.3f ms  jit %.3f ms  run %.3f ms  %zu casts\n",
+               configs[i].name, results[i].time_lift / rounds * 1e3,
+               results[i].time_jit / rounds * 1e3,
+               results[i].time_run / rounds * 1e3, results[i].casts);
+    }
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+
+#include <rellume/rellume.h>
+
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/TargetSelect.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+
+
+// Streaming copy with non-temporal loads and stores.
+//   void copy(void* dst, void* src, size_t len)
+static const uint8_t stream_code[] = {
+    0x66, 0x0f, 0x38, 0x2a, 0x06,             // 1: movntdqa xmm0, [rsi]
+    0x0f, 0x18, 0x86, 0x00, 0x02, 0x00, 0x00, // prefetchnta [rsi+0x200]
+    0x66, 0x0f, 0xe7, 0x07,                   // movntdq [rdi], xmm0
+    0x48, 0x83, 0xc6, 0x10,                   // add rsi, 0x10
+    0x48, 0x83, 0xc7, 0x10,                   // add rdi, 0x10
+    0x48, 0x83, 0xea, 0x10,                   // sub rdx, 0x10
+    0x75, 0xe2,                               // jnz 1b
+    0x0f, 0xae, 0xf8,                         // sfence
+    0xc3,                                     // ret
+};
+
+using CopyFn = void(*)(void*, void*, size_t);
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+static double measure(CopyFn fn, uint8_t* dst, uint8_t* src, size_t size,
+                      unsigned rounds) {
+    // Warm up, e.g. for page faults.
+    fn(dst, src, size);
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < rounds; i++)
+        fn(dst, src, size);
+    return size * rounds / seconds_since(start) / 1e9;
+}
+
+int main(int argc, char** argv) {
+    size_t size = argc > 1 ? strtoul(argv[1], nullptr, 0) : 64 << 20;
+    unsigned rounds = 10;
+    // aligned_alloc requires a multiple of the alignment.
+    size = (size + 0x3f) & ~size_t{0x3f};
+    if (size == 0)
+        size = 0x40;
+
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    auto src = static_cast<uint8_t*>(aligned_alloc(64, size));
+    auto dst = static_cast<uint8_t*>(aligned_alloc(64, size));
+    for (size_t i = 0; i < size; i++)
+        src[i] = static_cast<uint8_t>(i * 7);
+
+    void* native_mem = mmap(nullptr, sizeof(stream_code),
+                            PROT_READ|PROT_WRITE|PROT_EXEC,
+                            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (native_mem == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    memcpy(native_mem, stream_code, sizeof(stream_code));
+    auto native_fn = reinterpret_cast<CopyFn>(native_mem);
+
+    llvm::LLVMContext ctx;
+    auto mod = std::make_unique<llvm::Module>("bench_stream", ctx);
+    LLConfig* rlcfg = ll_config_new();
+    LLFunc* rlfn = ll_func_new(llvm::wrap(mod.get()), rlcfg);
+    ll_func_decode(rlfn, reinterpret_cast<uintptr_t>(stream_code));
+    llvm::Function* fn = llvm::unwrap<llvm::Function>(ll_func_lift(rlfn));
+    ll_func_dispose(rlfn);
+    if (fn == nullptr) {
+        fprintf(stderr, "error during lifting\n");
+        return 1;
+    }
+    ll_func_fast_opt(llvm::wrap(fn));
+
+    llvm::Type* i8p = llvm::Type::getInt8PtrTy(ctx);
+    llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+    llvm::FunctionType* fn_ty = llvm::FunctionType::get(
+            llvm::Type::getVoidTy(ctx), {i8p, i8p, i64}, false);
+    LLVMValueRef wrapped = ll_func_wrap_sysv2(llvm::wrap(fn), llvm::wrap(fn_ty),
+                                              llvm::wrap(mod.get()), 4096,
+                                              rlcfg);
+    ll_config_free(rlcfg);
+    if (wrapped == nullptr) {
+        fprintf(stderr, "error during wrapping\n");
+        return 1;
+    }
+
+    // The hints must survive the optimizations of the wrapper.
+    auto wrapped_fn = llvm::unwrap<llvm::Function>(wrapped);
+    size_t nontemporal = 0;
+    size_t prefetches = 0;
+    for (llvm::BasicBlock& bb : *wrapped_fn) {
+        for (llvm::Instruction& inst : bb) {
+            if (inst.getMetadata(llvm::LLVMContext::MD_nontemporal))
+                nontemporal++;
+            if (auto intr = llvm::dyn_cast<llvm::IntrinsicInst>(&inst))
+                prefetches += intr->getIntrinsicID() == llvm::Intrinsic::prefetch;
+        }
+    }
+    if (nontemporal < 2 || prefetches < 1) {
+        fprintf(stderr, "hints lost: %zu nontemporal, %zu prefetch\n",
+                nontemporal, prefetches);
+        return 1;
+    }
+
+    std::string name = wrapped_fn->getName().str();
+    std::string error;
+    llvm::EngineBuilder builder(std::move(mod));
+    builder.setEngineKind(llvm::EngineKind::JIT);
+    builder.setErrorStr(&error);
+    builder.setOptLevel(llvm::CodeGenOpt::Default);
+    std::unique_ptr<llvm::ExecutionEngine> engine(builder.create());
+    if (!engine) {
+        fprintf(stderr, "error creating engine: %s\n", error.c_str());
+        return 1;
+    }
+    auto lifted_fn = reinterpret_cast<CopyFn>(engine->getFunctionAddress(name));
+
+    double native_bw = measure(native_fn, dst, src, size, rounds);
+    memset(dst, 0, size);
+    double lifted_bw = measure(lifted_fn, dst, src, size, rounds);
+    if (memcmp(dst, src, size) != 0) {
+        fprintf(stderr, "lifted copy mismatch\n");
+        return 1;
+    }
+
+    printf("native: %.2f GB/s\n", native_bw);
+    printf("lifted: %.2f GB/s (%.0f%%)\n", lifted_bw,
+           lifted_bw / native_bw * 100);
+
+    munmap(native_mem, sizeof(stream_code));
+    free(src);
+    free(dst);
+    return 0;
+}
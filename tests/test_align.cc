@@ -0,0 +1,96 @@
+#include <rellume/rellume.h>
+
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+
+// The MOVAPS proves the alignment of the other accesses through RDI. The
+// decoder stops at the INT3.
+static const uint8_t sse_code[] = {
+    0x0f, 0x28, 0x07,                         // movaps xmm0, [rdi]
+    0x48, 0x8b, 0x47, 0x10,                   // mov rax, [rdi+0x10]
+    0x8b, 0x4f, 0x04,                         // mov ecx, [rdi+4]
+    0xcc,                                     // int3
+};
+
+// Without an aligned SSE access, nothing is known about RDI.
+static const uint8_t gp_code[] = {
+    0x48, 0x8b, 0x07,                         // mov rax, [rdi]
+    0x48, 0x8b, 0x4f, 0x10,                   // mov rcx, [rdi+0x10]
+    0xcc,                                     // int3
+};
+
+// At the entry of a function, RSP+8 is 16-byte aligned.
+static const uint8_t stack_code[] = {
+    0x53,                                     // push rbx
+    0x89, 0x4c, 0x24, 0xf8,                   // mov [rsp-8], ecx
+    0x5b,                                     // pop rbx
+    0xc3,                                     // ret
+};
+
+// Alignments of all loads and stores which don't access the CPU struct, in
+// the order of the function.
+static std::vector<unsigned> lift_alignments(const uint8_t* code,
+                                             bool track_stack) {
+    llvm::LLVMContext ctx;
+    auto mod = std::make_unique<llvm::Module>("test_align", ctx);
+    LLConfig* rlcfg = ll_config_new();
+    ll_config_enable_alignment_propagation(rlcfg, true);
+    ll_config_enable_stack_tracking(rlcfg, track_stack);
+    LLFunc* rlfn = ll_func_new(llvm::wrap(mod.get()), rlcfg);
+    ll_func_decode(rlfn, reinterpret_cast<uintptr_t>(code));
+    llvm::Function* fn = llvm::unwrap<llvm::Function>(ll_func_lift(rlfn));
+    ll_func_dispose(rlfn);
+    ll_config_free(rlcfg);
+
+    std::vector<unsigned> res;
+    if (fn == nullptr)
+        return res;
+
+    const llvm::DataLayout& dl = mod->getDataLayout();
+    for (llvm::BasicBlock& bb : *fn) {
+        for (llvm::Instruction& inst : bb) {
+            llvm::Value* ptr = llvm::getLoadStorePointerOperand(&inst);
+            if (ptr == nullptr)
+                continue;
+            int64_t offset = 0;
+            llvm::Value* base = llvm::GetPointerBaseWithConstantOffset(ptr, offset, dl);
+            if (llvm::isa<llvm::Argument>(base))
+                continue;
+            if (auto load = llvm::dyn_cast<llvm::LoadInst>(&inst))
+                res.push_back(load->getAlignment());
+            else
+                res.push_back(llvm::cast<llvm::StoreInst>(inst).getAlignment());
+        }
+    }
+    return res;
+}
+
+static bool check(const char* name, const std::vector<unsigned>& res,
+                  const std::vector<unsigned>& expected) {
+    if (res == expected)
+        return true;
+
+    fprintf(stderr, "%s: unexpected alignments:", name);
+    for (unsigned align : res)
+        fprintf(stderr, " %u", align);
+    fprintf(stderr, "\n");
+    return false;
+}
+
+int main() {
+    bool ok = true;
+    ok &= check("sse", lift_alignments(sse_code, false), {16, 16, 4});
+    ok &= check("gp", lift_alignments(gp_code, false), {1, 1});
+    // Push and pop have the ABI alignment (zero) unless it is increased.
+    ok &= check("stack", lift_alignments(stack_code, true), {16, 8, 16, 0});
+    return ok ? 0 : 1;
+}
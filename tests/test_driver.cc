@@ -26,6 +26,10 @@
 static bool opt_verbose = false;
 static bool opt_jit = false;
 static bool opt_overflow_intrinsics = false;
+static bool opt_pointer_provenance = false;
+static bool opt_stack = false;
+static bool opt_tso = false;
+static bool opt_trace = false;
 
 struct HexBuffer {
     uint8_t* buf;
@@ -134,6 +138,15 @@ class TestCase {
         return fail;
     }
 
+    bool IsMapped(uintptr_t addr) {
+        for (auto& map : mem_maps) {
+            uintptr_t start = reinterpret_cast<uintptr_t>(map.first);
+            if (addr >= start && addr < start + map.second)
+                return true;
+        }
+        return false;
+    }
+
     std::pair<std::string, std::string> split_arg(std::string arg) {
         size_t value_off = arg.find('=');
         if (value_off == std::string::npos) {
@@ -146,51 +159,29 @@ class TestCase {
         return std::make_pair(key_str, value_str);
     }
 
-    bool Run(std::string argstring) {
-        std::istringstream argstream(argstring);
-        std::string arg;
-        bool fail = false;
-
-        // 1. Setup initial state
-        CPU initial{};
-        getrandom(&initial, sizeof(initial), 0);
-
-        while (argstream >> arg) {
-            if (arg == "=>")
-                goto run_function;
-
-            auto kv = split_arg(arg);
-            if (kv.first[0] == 'm') {
-                AllocMem(kv.first, kv.second);
-            } else {
-                SetReg(kv.first, kv.second, &initial);
-            }
-        }
-
-        // We didn't run anything.
-        diagnostic << "# error: no emulation command" << std::endl;
-        return true;
-
-    run_function:
-
-        // 2. Emulate function
-        CPU state = initial;
-
+    // Lift the code at the current RIP and run it once. Returns true on error,
+    // lifted is false if no code could be decoded.
+    bool Emulate(CPU* state, LLDecodeStop stop, bool* lifted) {
         llvm::LLVMContext ctx;
         auto mod = std::make_unique<llvm::Module>("rellume_test", ctx);
 
         LLConfig* rlcfg = ll_config_new();
         ll_config_enable_verify_ir(rlcfg, true);
         ll_config_enable_overflow_intrinsics(rlcfg, opt_overflow_intrinsics);
+        ll_config_enable_pointer_provenance(rlcfg, opt_pointer_provenance);
+        ll_config_enable_stack_promotion(rlcfg, opt_stack);
+        ll_config_enable_stack_tracking(rlcfg, opt_stack);
+        if (opt_tso)
+            ll_config_set_memory_model(rlcfg, RELLUME_MEMORY_MODEL_TSO);
         LLFunc* rlfn = ll_func_new(llvm::wrap(mod.get()), rlcfg);
-        ll_func_decode(rlfn, *reinterpret_cast<uint64_t*>(&state.rip));
+        ll_func_decode3(rlfn, *reinterpret_cast<uint64_t*>(&state->rip), stop,
+                        nullptr, nullptr);
         llvm::Function* fn = llvm::unwrap<llvm::Function>(ll_func_lift(rlfn));
         ll_func_dispose(rlfn);
         ll_config_free(rlcfg);
-        if (fn == nullptr) {
-            diagnostic << "# error during lifting" << std::endl;
-            return true;
-        }
+        *lifted = fn != nullptr;
+        if (fn == nullptr)
+            return false;
 
         fn->setName("test_function");
         if (opt_verbose)
@@ -221,9 +212,9 @@ class TestCase {
             // Otherwise try to run the function using the interpreter.
             if (auto raw_ptr = engine->getFunctionAddress(fn->getName())) {
                 auto fn_ptr = reinterpret_cast<void(*)(CPU*)>(raw_ptr);
-                fn_ptr(&state);
+                fn_ptr(state);
             } else {
-                engine->runFunction(fn, {llvm::PTOGV(&state)});
+                engine->runFunction(fn, {llvm::PTOGV(state)});
             }
             delete engine;
         } else {
@@ -231,6 +222,63 @@ class TestCase {
             return true;
         }
 
+        return false;
+    }
+
+    bool Run(std::string argstring) {
+        std::istringstream argstream(argstring);
+        std::string arg;
+        bool fail = false;
+
+        // 1. Setup initial state
+        CPU initial{};
+        getrandom(&initial, sizeof(initial), 0);
+
+        while (argstream >> arg) {
+            if (arg == "=>")
+                goto run_function;
+
+            auto kv = split_arg(arg);
+            if (kv.first[0] == 'm') {
+                AllocMem(kv.first, kv.second);
+            } else {
+                SetReg(kv.first, kv.second, &initial);
+            }
+        }
+
+        // We didn't run anything.
+        diagnostic << "# error: no emulation command" << std::endl;
+        return true;
+
+    run_function:
+
+        // 2. Emulate function
+        CPU state = initial;
+
+        if (!opt_trace) {
+            bool lifted;
+            if (Emulate(&state, RELLUME_DECODE_ALL, &lifted))
+                return true;
+            if (!lifted) {
+                diagnostic << "# error during lifting" << std::endl;
+                return true;
+            }
+        } else {
+            // Run traces one after another, each starting where the previous
+            // one was left, until execution leaves the mapped memory or
+            // reaches an instruction which can't be decoded.
+            for (unsigned i = 0; i < 1000; i++) {
+                uint64_t rip = *reinterpret_cast<uint64_t*>(&state.rip);
+                if (!IsMapped(rip))
+                    break;
+                bool lifted;
+                if (Emulate(&state, RELLUME_DECODE_TRACE, &lifted))
+                    return true;
+                if (!lifted || *reinterpret_cast<uint64_t*>(&state.rip) == rip)
+                    break;
+            }
+        }
+
         // 3. Compare with expected values
         //  - memory is compared immediately
         //  - registers are compared separately to support undefined values
@@ -284,14 +332,18 @@ public:
 
 int main(int argc, char** argv) {
     int opt;
-    while ((opt = getopt(argc, argv, "vji")) != -1) {
+    while ((opt = getopt(argc, argv, "vjipstr")) != -1) {
         switch (opt) {
         case 'v': opt_verbose = true; break;
         case 'j': opt_jit = true; break;
         case 'i': opt_overflow_intrinsics = true; break;
+        case 'p': opt_pointer_provenance = true; break;
+        case 's': opt_stack = true; break;
+        case 't': opt_tso = true; break;
+        case 'r': opt_trace = true; break;
         default:
 usage:
-            std::cerr << "usage: " << argv[0] << " [-v] [-j] casefile" << std::endl;
+            std::cerr << "usage: " << argv[0] << " [-v] [-j] [-i] [-p] [-s] [-t] [-r] casefile" << std::endl;
             return 1;
         }
     }
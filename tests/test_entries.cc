@@ -0,0 +1,99 @@
+#include "test_util.h"
+
+#include <llvm/IR/LLVMContext.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+
+// The second instruction is an additional entry.
+static const uint8_t entries_code[] = {
+    0x48, 0x83, 0xc0, 0x01,                   // add rax, 1
+    0x48, 0x83, 0xc0, 0x10,                   // add rax, 0x10
+    0xc3,                                     // ret
+};
+
+using SptrFn = void(*)(void*);
+
+// Run the function starting at rip and check the final rax and rip.
+static bool run(LLConfig* cfg, SptrFn fn, uint64_t rip, uint64_t exp_rax,
+                uint64_t exp_rip) {
+    uint64_t stack[2] = {0x1234567890, 0};
+    CPU cpu = {};
+    write_reg(cfg, cpu, "rip", rip);
+    write_reg(cfg, cpu, "rsp", reinterpret_cast<uint64_t>(&stack[0]));
+    fn(&cpu);
+
+    uint64_t rax = read_reg(cfg, cpu, "rax");
+    uint64_t new_rip = read_reg(cfg, cpu, "rip");
+    if (rax != exp_rax || new_rip != exp_rip) {
+        fprintf(stderr, "entry %#lx: wrong result rax=%#lx rip=%#lx\n",
+                static_cast<unsigned long>(rip),
+                static_cast<unsigned long>(rax),
+                static_cast<unsigned long>(new_rip));
+        return false;
+    }
+    return true;
+}
+
+static const char* const gp_regs[] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+// Run the function starting at rip, which is not an entry. The function must
+// exit through the dispatcher with the whole CPU state unchanged.
+static bool run_unknown(LLConfig* cfg, SptrFn fn, uint64_t rip) {
+    CPU cpu = {};
+    write_reg(cfg, cpu, "rip", rip);
+    for (unsigned i = 0; i < 16; i++)
+        write_reg(cfg, cpu, gp_regs[i], 0x1111111111111111 * (i + 1));
+    CPU orig = cpu;
+    fn(&cpu);
+
+    if (!memcmp(cpu.data, orig.data, ll_config_cpu_struct_size(cfg)))
+        return true;
+    fprintf(stderr, "unknown entry %#lx: state modified\n",
+            static_cast<unsigned long>(rip));
+    if (read_reg(cfg, cpu, "rip") != rip)
+        fprintf(stderr, "  rip=%#lx\n",
+                static_cast<unsigned long>(read_reg(cfg, cpu, "rip")));
+    for (unsigned i = 0; i < 16; i++) {
+        uint64_t val = read_reg(cfg, cpu, gp_regs[i]);
+        if (val != read_reg(cfg, orig, gp_regs[i]))
+            fprintf(stderr, "  %s=%#lx\n", gp_regs[i],
+                    static_cast<unsigned long>(val));
+    }
+    return false;
+}
+
+int main() {
+    uint64_t start = reinterpret_cast<uintptr_t>(entries_code);
+
+    llvm::LLVMContext ctx;
+    auto mod = std::make_unique<llvm::Module>("test_entries", ctx);
+    LLConfig* rlcfg = ll_config_new();
+    LLFunc* rlfn = ll_func_new(llvm::wrap(mod.get()), rlcfg);
+    // The entry added before decoding must not replace the start address.
+    ll_func_add_entry(rlfn, start + 4);
+    ll_func_decode(rlfn, start);
+    std::unique_ptr<llvm::ExecutionEngine> engine;
+    uint64_t addr = jit_lifted(rlfn, std::move(mod), &engine);
+    ll_func_dispose(rlfn);
+    if (addr == 0)
+        return 1;
+    auto sptr_fn = reinterpret_cast<SptrFn>(addr);
+
+    bool ok = true;
+    ok &= run(rlcfg, sptr_fn, start, 0x11, 0x1234567890);
+    ok &= run(rlcfg, sptr_fn, start + 4, 0x10, 0x1234567890);
+    // Unknown instruction pointers leave the state unchanged, both inside
+    // and outside of the decoded code.
+    ok &= run_unknown(rlcfg, sptr_fn, start + 8);
+    ok &= run_unknown(rlcfg, sptr_fn, start + 2);
+    ok &= run_unknown(rlcfg, sptr_fn, 0x1234567890);
+    ll_config_free(rlcfg);
+    return ok ? 0 : 1;
+}
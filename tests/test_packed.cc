@@ -0,0 +1,70 @@
+#include "test_util.h"
+
+#include <llvm/IR/LLVMContext.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+
+
+// INC leaves CF unmodified, ADC reads it from the flag word.
+static const uint8_t packed_code[] = {
+    0x48, 0xff, 0xc0,                         // inc rax
+    0x48, 0x83, 0xd3, 0x00,                   // adc rbx, 0
+    0xc3,                                     // ret
+};
+
+using SptrFn = void(*)(void*);
+
+int main() {
+    llvm::LLVMContext ctx;
+    auto mod = std::make_unique<llvm::Module>("test_packed", ctx);
+    LLConfig* rlcfg = ll_config_new();
+    ll_config_set_cpu_layout(rlcfg, RELLUME_CPU_LAYOUT_PACKED);
+    LLFunc* rlfn = ll_func_new(llvm::wrap(mod.get()), rlcfg);
+    ll_func_decode(rlfn, reinterpret_cast<uintptr_t>(packed_code));
+    std::unique_ptr<llvm::ExecutionEngine> engine;
+    uint64_t addr = jit_lifted(rlfn, std::move(mod), &engine);
+    ll_func_dispose(rlfn);
+    if (addr == 0)
+        return 1;
+    auto sptr_fn = reinterpret_cast<SptrFn>(addr);
+
+    if (ll_config_cpu_struct_size(rlcfg) > sizeof(CPU::data)) {
+        fprintf(stderr, "CPU struct too large\n");
+        return 1;
+    }
+
+    uint64_t stack[2] = {0x1234567890, 0};
+    CPU cpu = {};
+    write_reg(rlcfg, cpu, "rsp", reinterpret_cast<uint64_t>(&stack[0]));
+    write_reg(rlcfg, cpu, "rax", 0xffffffffffffffff);
+    write_reg(rlcfg, cpu, "rbx", 0x10);
+    // CF and the non-arithmetic bits TF and IF (and the reserved bit 1) are
+    // set and must be preserved.
+    write_reg(rlcfg, cpu, "eflags", 0x0303);
+    sptr_fn(&cpu);
+
+    bool ok = true;
+    uint64_t rax = read_reg(rlcfg, cpu, "rax");
+    uint64_t rbx = read_reg(rlcfg, cpu, "rbx");
+    uint64_t rip = read_reg(rlcfg, cpu, "rip");
+    if (rax != 0 || rbx != 0x11 || rip != stack[0]) {
+        fprintf(stderr, "wrong registers: rax=%#lx rbx=%#lx rip=%#lx\n",
+                static_cast<unsigned long>(rax),
+                static_cast<unsigned long>(rbx),
+                static_cast<unsigned long>(rip));
+        ok = false;
+    }
+
+    // ADC computes 0x10+0+1: only PF is set, the other bits are unchanged.
+    uint64_t eflags = read_reg(rlcfg, cpu, "eflags");
+    if (eflags != 0x0306) {
+        fprintf(stderr, "wrong flag word: %#lx\n",
+                static_cast<unsigned long>(eflags));
+        ok = false;
+    }
+
+    ll_config_free(rlcfg);
+    return ok ? 0 : 1;
+}
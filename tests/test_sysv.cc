@@ -0,0 +1,92 @@
+
+#include "test_util.h"
+
+#include <llvm/IR/LLVMContext.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <emmintrin.h>
+#include <memory>
+
+
+// Uses all integer and some vector argument registers.
+static const uint8_t sysv_code[] = {
+    0x48, 0x8d, 0x04, 0x37,                   // lea rax, [rdi+rsi]
+    0x48, 0x01, 0xd0,                         // add rax, rdx
+    0x48, 0x01, 0xc8,                         // add rax, rcx
+    0x4c, 0x01, 0xc0,                         // add rax, r8
+    0x4c, 0x01, 0xc8,                         // add rax, r9
+    0x48, 0x89, 0xfa,                         // mov rdx, rdi
+    0x66, 0x0f, 0xd4, 0xc7,                   // paddq xmm0, xmm7
+    0x66, 0x0f, 0x6f, 0xce,                   // movdqa xmm1, xmm6
+    0xc3,                                     // ret
+};
+
+struct GpResult {
+    uint64_t rax;
+    uint64_t rdx;
+};
+
+// The lifted function returns {rax, rdx, xmm0, xmm1} in registers. From C,
+// the first two are returned like a 16-byte struct, xmm0 like a __m128i.
+#define SYSV_PARAMS uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, \
+                    uint64_t, __m128i, __m128i, __m128i, __m128i, __m128i, \
+                    __m128i, __m128i, __m128i, void*
+using GpFn = GpResult(*)(SYSV_PARAMS);
+using VecFn = __m128i(*)(SYSV_PARAMS);
+
+int main() {
+    llvm::LLVMContext ctx;
+    auto mod = std::make_unique<llvm::Module>("test_sysv", ctx);
+    LLConfig* rlcfg = ll_config_new();
+    ll_config_set_call_conv(rlcfg, RELLUME_CALL_CONV_SYSV);
+    LLFunc* rlfn = ll_func_new(llvm::wrap(mod.get()), rlcfg);
+    ll_func_decode(rlfn, reinterpret_cast<uintptr_t>(sysv_code));
+    std::unique_ptr<llvm::ExecutionEngine> engine;
+    uint64_t addr = jit_lifted(rlfn, std::move(mod), &engine);
+    ll_func_dispose(rlfn);
+    if (addr == 0)
+        return 1;
+
+    // The return address popped by RET is stored as RIP in the CPU struct.
+    uint64_t stack[2] = {0x1234567890, 0};
+    CPU cpu = {};
+    uint64_t rsp = reinterpret_cast<uint64_t>(&stack[0]);
+    write_reg(rlcfg, cpu, "rsp", rsp);
+
+    __m128i x[8];
+    for (int i = 0; i < 8; i++)
+        x[i] = _mm_set_epi64x(0x100 * i + 1, 0x100 * i);
+
+    auto gp_fn = reinterpret_cast<GpFn>(addr);
+    GpResult gp = gp_fn(1, 2, 4, 8, 16, 32, x[0], x[1], x[2], x[3], x[4],
+                        x[5], x[6], x[7], &cpu);
+    if (gp.rax != 63 || gp.rdx != 1) {
+        fprintf(stderr, "wrong GP result: rax=%#lx rdx=%#lx\n",
+                static_cast<unsigned long>(gp.rax),
+                static_cast<unsigned long>(gp.rdx));
+        return 1;
+    }
+
+    uint64_t rip = read_reg(rlcfg, cpu, "rip");
+    if (rip != stack[0]) {
+        fprintf(stderr, "wrong RIP: %#lx\n", static_cast<unsigned long>(rip));
+        return 1;
+    }
+
+    write_reg(rlcfg, cpu, "rsp", rsp);
+    auto vec_fn = reinterpret_cast<VecFn>(addr);
+    __m128i xmm0 = vec_fn(1, 2, 4, 8, 16, 32, x[0], x[1], x[2], x[3], x[4],
+                          x[5], x[6], x[7], &cpu);
+    uint64_t res[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(res), xmm0);
+    if (res[0] != 0x700 || res[1] != 0x702) {
+        fprintf(stderr, "wrong XMM0 result: %#lx %#lx\n",
+                static_cast<unsigned long>(res[0]),
+                static_cast<unsigned long>(res[1]));
+        return 1;
+    }
+
+    ll_config_free(rlcfg);
+    return 0;
+}
@@ -0,0 +1,77 @@
+
+#ifndef LL_TEST_UTIL_H
+#define LL_TEST_UTIL_H
+
+#include <rellume/rellume.h>
+
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/TargetSelect.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+
+// Helpers for the standalone tests which execute lifted code.
+
+/// CPU struct, large enough for all supported layouts.
+struct CPU {
+    uint8_t data[4096];
+} __attribute__((aligned(64)));
+
+/// Offset of a 64-bit register in the CPU struct layout of the configuration.
+/// Aborts for names which are not part of the layout.
+static inline size_t reg_offset(LLConfig* cfg, const char* name) {
+    int64_t offset = ll_config_cpu_reg_offset(cfg, name);
+    if (offset < 0 || offset + 8 > static_cast<int64_t>(sizeof(CPU::data))) {
+        fprintf(stderr, "invalid register %s\n", name);
+        abort();
+    }
+    return offset;
+}
+
+static inline uint64_t read_reg(LLConfig* cfg, const CPU& cpu, const char* name) {
+    uint64_t val;
+    memcpy(&val, cpu.data + reg_offset(cfg, name), sizeof(val));
+    return val;
+}
+
+static inline void write_reg(LLConfig* cfg, CPU& cpu, const char* name,
+                             uint64_t val) {
+    memcpy(cpu.data + reg_offset(cfg, name), &val, sizeof(val));
+}
+
+/// Lift the decoded function into mod, optimize and JIT-compile it. Returns
+/// the address of the code, or 0 on error. The engine owns the module and the
+/// code afterwards.
+static inline uint64_t jit_lifted(LLFunc* rlfn, std::unique_ptr<llvm::Module> mod,
+                                  std::unique_ptr<llvm::ExecutionEngine>* engine) {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    llvm::Function* fn = llvm::unwrap<llvm::Function>(ll_func_lift(rlfn));
+    if (fn == nullptr) {
+        fprintf(stderr, "error during lifting\n");
+        return 0;
+    }
+    fn->setName("test_function");
+    ll_func_fast_opt(llvm::wrap(fn));
+
+    std::string error;
+    llvm::EngineBuilder builder(std::move(mod));
+    builder.setEngineKind(llvm::EngineKind::JIT);
+    builder.setErrorStr(&error);
+    engine->reset(builder.create());
+    if (!*engine) {
+        fprintf(stderr, "error creating engine: %s\n", error.c_str());
+        return 0;
+    }
+    return (*engine)->getFunctionAddress("test_function");
+}
+
+#endif